@@ -0,0 +1,403 @@
+/*-
+ * Copyright 2021 zhuyie
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions 
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures bsdiff() on a pair of files held in memory, so that only the
+ * diff engine and the packer are timed.
+ *
+ *   bsdiff_bench [-c] [-x] [-j max_threads] [-n repeat] [-C cachedir] oldfile newfile
+ *
+ * Every configuration is run `repeat` times and the best time is printed.
+ * With -c, every patch is also applied and checked against newfile.
+ * With -x, only the cancellation of a diff by its progress callback is
+ * checked.
+ * Each section varies one bsdiff_ctx field from the default context.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "bsdiff.h"
+
+static double now_ms(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER freq, counter;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static void log_error(void *opaque, const char *errmsg)
+{
+	(void)opaque;
+	fprintf(stderr, "%s", errmsg);
+}
+
+static void *load_file(const char *filename, size_t *size)
+{
+	FILE *f;
+	long n;
+	void *buf = NULL;
+
+	if ((f = fopen(filename, "rb")) == NULL)
+		return NULL;
+	if (fseek(f, 0, SEEK_END) != 0 || (n = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0)
+		goto cleanup;
+	if ((buf = malloc((size_t)n + 1)) == NULL)
+		goto cleanup;
+	if (fread(buf, 1, (size_t)n, f) != (size_t)n) {
+		free(buf);
+		buf = NULL;
+		goto cleanup;
+	}
+	*size = (size_t)n;
+
+cleanup:
+	fclose(f);
+	return buf;
+}
+
+/* Runs one diff, returns the elapsed milliseconds or a negative value on error.
+   With `check`, the patch is applied and compared to new. */
+static double run_diff(struct bsdiff_ctx *ctx, int check,
+	const void *old, size_t oldsize, const void *new, size_t newsize, int64_t *patchsize)
+{
+	double start, elapsed;
+	void *patch = NULL, *out = NULL;
+	size_t cb = 0, outsize = 0;
+
+	start = now_ms();
+	if (bsdiff_buffers(ctx, old, oldsize, new, newsize, &patch, &cb) != BSDIFF_SUCCESS)
+		return -1.0;
+	elapsed = now_ms() - start;
+	*patchsize = (int64_t)cb;
+
+	if (check) {
+		if ((bspatch_buffers(ctx, old, oldsize, patch, cb, &out, &outsize) != BSDIFF_SUCCESS) ||
+			(outsize != newsize) || (memcmp(out, new, newsize) != 0))
+		{
+			fprintf(stderr, "patch doesn't reproduce newfile\n");
+			elapsed = -1.0;
+		}
+		bsdiff_free(out);
+	}
+	bsdiff_free(patch);
+
+	return elapsed;
+}
+
+/* Runs a configuration `repeat` times and prints the best time. The patch
+   size is returned in `patchsize_out` if not NULL. */
+static int bench(const char *label, struct bsdiff_ctx *ctx, int repeat, int check,
+	const void *old, size_t oldsize, const void *new, size_t newsize,
+	int64_t *patchsize_out)
+{
+	int i;
+	double t, best = -1.0;
+	int64_t patchsize = 0;
+
+	for (i = 0; i < repeat; i++) {
+		t = run_diff(ctx, check && i == 0, old, oldsize, new, newsize, &patchsize);
+		if (t < 0) {
+			fprintf(stderr, "%s: bsdiff failed\n", label);
+			return 1;
+		}
+		if (best < 0 || t < best)
+			best = t;
+	}
+	printf("%-24s %10.1f %12lld %10.2f\n", label, best, (long long)patchsize,
+		(best > 0) ? ((double)newsize / 1048576.0) / (best / 1000.0) : 0.0);
+	if (patchsize_out != NULL)
+		*patchsize_out = patchsize;
+	return 0;
+}
+
+/* Cancels the diff in the middle of the scan */
+static int cancel_scan(void *opaque, int phase, int64_t done, int64_t total)
+{
+	(void)opaque;
+	return (phase == BSDIFF_PHASE_SCAN && done > 0 && done < total) ? 1 : 0;
+}
+
+/* Checks that a diff cancelled by its progress callback fails with
+   BSDIFF_CANCELED and returns no patch: bsdiff_buffers() with the serial,
+   partitioned and windowed scans, and bsdiff_multi() for every target. */
+static int check_cancel(const void *old, size_t oldsize, const void *new, size_t newsize)
+{
+	int ret = 1;
+	int i, k;
+	void *patch;
+	size_t cb;
+	struct bsdiff_ctx ctx = { 0 };
+	struct bsdiff_stream oldfile = { 0 }, newfiles[2] = { { 0 } }, patchfiles[2] = { { 0 } };
+	struct bsdiff_patch_packer packers[2] = { { 0 } };
+	struct bsdiff_target targets[2];
+	const void *buffer;
+
+	ctx.log_error = log_error;
+	ctx.progress = cancel_scan;
+	ctx.progress_interval = 4096;
+	for (k = 0; k < 3; k++) {
+		ctx.scan_partitions = (k == 1) ? 4 : 0;
+		ctx.num_threads = (k == 1) ? 4 : 0;
+		ctx.memory_budget = (k == 2) ? ((int64_t)1 << 20) : 0;
+		patch = (void*)&ctx;  /* must be reset */
+		cb = 1;
+		i = bsdiff_buffers(&ctx, old, oldsize, new, newsize, &patch, &cb);
+		if (i != BSDIFF_CANCELED || patch != NULL || cb != 0) {
+			fprintf(stderr, "cancel %d: bsdiff_buffers returned %d, patch %p, %llu bytes\n",
+				k, i, patch, (unsigned long long)cb);
+			bsdiff_free(patch);
+			return 1;
+		}
+	}
+
+	ctx.scan_partitions = 0;
+	ctx.memory_budget = 0;
+	ctx.num_threads = 2;
+	if (bsdiff_open_memory_stream(BSDIFF_MODE_READ, old, oldsize, &oldfile) != BSDIFF_SUCCESS)
+		goto cleanup;
+	for (i = 0; i < 2; i++) {
+		if ((bsdiff_open_memory_stream(BSDIFF_MODE_READ, new, newsize, &newfiles[i]) != BSDIFF_SUCCESS) ||
+			(bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, NULL, 0, &patchfiles[i]) != BSDIFF_SUCCESS) ||
+			(bsdiff_open_bz2_patch_packer(BSDIFF_MODE_WRITE, &patchfiles[i], &packers[i]) != BSDIFF_SUCCESS))
+		{
+			goto cleanup;
+		}
+		targets[i].newfile = &newfiles[i];
+		targets[i].packer = &packers[i];
+		targets[i].ret = BSDIFF_SUCCESS;
+	}
+	i = bsdiff_multi(&ctx, &oldfile, targets, 2);
+	if (i != BSDIFF_CANCELED || targets[0].ret != BSDIFF_CANCELED || targets[1].ret != BSDIFF_CANCELED) {
+		fprintf(stderr, "cancel: bsdiff_multi returned %d, targets %d %d\n", i, targets[0].ret, targets[1].ret);
+		goto cleanup;
+	}
+	/* no patch was flushed: at most the header of the packer */
+	for (i = 0; i < 2; i++) {
+		if (patchfiles[i].get_buffer(patchfiles[i].state, &buffer, &cb) != BSDIFF_SUCCESS || cb > 32) {
+			fprintf(stderr, "cancel: target %d wrote %llu bytes\n", i, (unsigned long long)cb);
+			goto cleanup;
+		}
+	}
+
+	printf("cancel: ok\n");
+	ret = 0;
+
+cleanup:
+	for (i = 0; i < 2; i++) {
+		bsdiff_close_patch_packer(&packers[i]);
+		bsdiff_close_stream(&patchfiles[i]);
+		bsdiff_close_stream(&newfiles[i]);
+	}
+	bsdiff_close_stream(&oldfile);
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-c] [-x] [-j max_threads] [-n repeat] [-C cachedir] oldfile newfile\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = 1;
+	int i, k, threads;
+	int max_threads = 1, repeat = 3, check = 0, cancel = 0;
+	int64_t serialsize = 0, patchsize;
+	const char *cachedir = NULL;
+	char label[64];
+	void *old = NULL, *new = NULL;
+	size_t oldsize = 0, newsize = 0;
+	struct bsdiff_ctx ctx = { 0 };
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-c") == 0) {
+			check = 1;
+		} else if (strcmp(argv[i], "-x") == 0) {
+			cancel = 1;
+		} else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			max_threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+			cachedir = argv[++i];
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			repeat = atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - i != 2 || max_threads < 1 || repeat < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if ((old = load_file(argv[i], &oldsize)) == NULL) {
+		fprintf(stderr, "can't load oldfile: %s\n", argv[i]);
+		goto cleanup;
+	}
+	if ((new = load_file(argv[i + 1], &newsize)) == NULL) {
+		fprintf(stderr, "can't load newfile: %s\n", argv[i + 1]);
+		goto cleanup;
+	}
+
+	if (cancel) {
+		ret = check_cancel(old, oldsize, new, newsize);
+		goto cleanup;
+	}
+
+	printf("old: %s (%llu bytes)\nnew: %s (%llu bytes)\n\n",
+		argv[i], (unsigned long long)oldsize, argv[i + 1], (unsigned long long)newsize);
+	printf("%-24s %10s %12s %10s\n", "config", "best ms", "patch bytes", "MB/s");
+
+	ctx.log_error = log_error;
+
+	/* suffix array construction threads */
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		ctx.num_threads = threads;
+		snprintf(label, sizeof(label), "threads=%d", threads);
+		if (bench(label, &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+			goto cleanup;
+	}
+	ctx.num_threads = 0;
+
+	/* block-split compression threads of the bz2 packer */
+	for (threads = 2; threads <= max_threads; threads *= 2) {
+		ctx.compress_threads = threads;
+		snprintf(label, sizeof(label), "compress_threads=%d", threads);
+		if (bench(label, &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+			goto cleanup;
+	}
+	ctx.compress_threads = 0;
+
+	/* bucket table prefix length: time and memory of the table */
+	for (k = -1; k <= 3; k++) {
+		if (k == 0)
+			continue;
+		ctx.bucket_bytes = k;
+		if (k < 0)
+			snprintf(label, sizeof(label), "bucket=off");
+		else
+			snprintf(label, sizeof(label), "bucket=%d (%lluK)", k,
+				(unsigned long long)((((uint64_t)1 << (8 * k)) + 1) * (oldsize < 0x7fffffff ? 4 : 8) / 1024));
+		if (bench(label, &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+			goto cleanup;
+	}
+	ctx.bucket_bytes = 0;
+
+	/* partitioned scan: patch size relative to the serial scan */
+	for (k = 1; k <= 16; k *= 2) {
+		ctx.scan_partitions = k;
+		snprintf(label, sizeof(label), "partitions=%d", k);
+		if (bench(label, &ctx, repeat, check, old, oldsize, new, newsize, &patchsize) != 0)
+			goto cleanup;
+		if (k == 1)
+			serialsize = patchsize;
+		else if (serialsize > 0)
+			printf("%-24s %+.3f%%\n", "", 100.0 * (double)(patchsize - serialsize) / (double)serialsize);
+	}
+	ctx.scan_partitions = 0;
+
+	/* sparse suffix array: index memory, time and patch size */
+	for (k = 2; k <= 16; k *= 2) {
+		ctx.sa_sample_rate = k;
+		snprintf(label, sizeof(label), "sample=%d (%lluK)", k,
+			(unsigned long long)((oldsize / k + 1) * 4 / 1024));
+		if (bench(label, &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+			goto cleanup;
+	}
+	ctx.sa_sample_rate = 0;
+
+	/* match engines: suffix array vs hash chains */
+	ctx.match_engine = BSDIFF_ENGINE_SA;
+	if (bench("engine=sa", &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+		goto cleanup;
+	ctx.match_engine = BSDIFF_ENGINE_HASH;
+	if (bench("engine=hash", &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+		goto cleanup;
+	ctx.match_engine = BSDIFF_ENGINE_SA;
+
+	/* successor search, with and without the bucket table */
+	ctx.successor_search = 1;
+	if (bench("successor", &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+		goto cleanup;
+	ctx.bucket_bytes = -1;
+	if (bench("successor, no bucket", &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+		goto cleanup;
+	ctx.successor_search = 0;
+	if (bench("no bucket", &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+		goto cleanup;
+	ctx.bucket_bytes = 0;
+
+	/* fast-forward over runs of equal bytes at the current alignment */
+	for (k = 64; k <= 65536; k *= 16) {
+		ctx.fast_forward = k;
+		snprintf(label, sizeof(label), "fast_forward=%d", k);
+		if (bench(label, &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+			goto cleanup;
+	}
+	ctx.fast_forward = 0;
+
+	/* speed/size presets */
+	for (k = 1; k <= 9; k++) {
+		ctx.level = k;
+		snprintf(label, sizeof(label), "level=%d", k);
+		if (bench(label, &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+			goto cleanup;
+	}
+	ctx.level = 0;
+
+	/* suffix array cache: the first run fills it, the next ones map it */
+	if (cachedir != NULL) {
+		ctx.sa_cache_dir = cachedir;
+		if (bench("sa_cache (first)", &ctx, 1, check, old, oldsize, new, newsize, NULL) != 0 ||
+			bench("sa_cache", &ctx, repeat, check, old, oldsize, new, newsize, NULL) != 0)
+		{
+			goto cleanup;
+		}
+		ctx.sa_cache_dir = NULL;
+	}
+
+	ret = 0;
+
+cleanup:
+	free(new);
+	free(old);
+
+	return ret;
+}
@@ -0,0 +1,192 @@
+/*
+ * Microbenchmark of the matchlen, sub, add and eqcount kernels in source/simd.c.
+ *
+ *   matchlen_bench [-c]
+ *
+ * Prints the throughput of every implementation supported by the CPU for
+ * a range of match lengths, then the throughput of the sub, add and
+ * eqcount kernels. With -c it only checks that all of them agree with the
+ * scalar one and returns non-zero otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+
+#define BUF_LEN (1 << 20)
+
+static double now_ms(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER freq, counter;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static int check(const struct bsdiff_simd_impl **impls, int count, uint8_t *a, uint8_t *b)
+{
+	int i, k, off, len, mis;
+	int64_t expect, got;
+	uint8_t expect_buf[320], got_buf[320];
+
+	srand(1);
+	for (k = 0; k < 100000; k++) {
+		off = rand() % 64;
+		len = rand() % 300;
+		mis = rand() % 320;
+		memcpy(b + off, a + off, (size_t)len);
+		if (mis < len)
+			b[off + mis] ^= (uint8_t)(1 + rand() % 255);
+		expect = impls[0]->matchlen(a + off, b + off, len);
+		for (i = 1; i < count; i++) {
+			got = impls[i]->matchlen(a + off, b + off, len);
+			if (got != expect) {
+				fprintf(stderr, "%s: matchlen(len=%d) = %lld, expected %lld\n",
+					impls[i]->name, len, (long long)got, (long long)expect);
+				return 1;
+			}
+		}
+	}
+	for (k = 0; k < 10000; k++) {
+		off = rand() % 64;
+		len = rand() % 300;
+		impls[0]->sub(expect_buf, a + off, b + 64 + off, len);
+		for (i = 1; i < count; i++) {
+			memset(got_buf, 0xA5, sizeof(got_buf));
+			impls[i]->sub(got_buf, a + off, b + 64 + off, len);
+			if (memcmp(got_buf, expect_buf, (size_t)len) != 0 || got_buf[len] != 0xA5) {
+				fprintf(stderr, "%s: sub(len=%d) differs\n", impls[i]->name, len);
+				return 1;
+			}
+		}
+	}
+	for (k = 0; k < 10000; k++) {
+		off = rand() % 64;
+		len = rand() % 300;
+		impls[0]->add(expect_buf, a + off, b + 64 + off, len);
+		for (i = 1; i < count; i++) {
+			memset(got_buf, 0xA5, sizeof(got_buf));
+			impls[i]->add(got_buf, a + off, b + 64 + off, len);
+			if (memcmp(got_buf, expect_buf, (size_t)len) != 0 || got_buf[len] != 0xA5) {
+				fprintf(stderr, "%s: add(len=%d) differs\n", impls[i]->name, len);
+				return 1;
+			}
+		}
+	}
+	for (k = 0; k < 10000; k++) {
+		off = rand() % 64;
+		len = rand() % 2000;
+		for (i = 0; i < 8; i++)
+			b[off + rand() % (len + 1)] ^= (uint8_t)rand();
+		expect = impls[0]->eqcount(a + off, b + off, len);
+		for (i = 1; i < count; i++) {
+			got = impls[i]->eqcount(a + off, b + off, len);
+			if (got != expect) {
+				fprintf(stderr, "%s: eqcount(len=%d) = %lld, expected %lld\n",
+					impls[i]->name, len, (long long)got, (long long)expect);
+				return 1;
+			}
+		}
+	}
+	/* more than 255 rounds of the byte counters */
+	memcpy(b, a, BUF_LEN);
+	for (i = 0; i < count; i++) {
+		if (impls[i]->eqcount(a, b, BUF_LEN) != BUF_LEN) {
+			fprintf(stderr, "%s: eqcount of equal buffers\n", impls[i]->name);
+			return 1;
+		}
+	}
+	printf("%d implementations agree\n", count);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int lengths[] = { 8, 32, 256, 4096, 65536, BUF_LEN - 1 };
+	const struct bsdiff_simd_impl *impls[8];
+	int count, i, l, reps, r;
+	uint8_t *a, *b;
+	int64_t sink = 0;
+	double t;
+
+	a = malloc(BUF_LEN);
+	b = malloc(BUF_LEN);
+	if (!a || !b)
+		return 1;
+	for (i = 0; i < BUF_LEN; i++)
+		a[i] = (uint8_t)rand();
+	memcpy(b, a, BUF_LEN);
+
+	count = bsdiff_simd_impls(impls, 8);
+	if (argc > 1 && strcmp(argv[1], "-c") == 0)
+		return check(impls, count, a, b);
+
+	printf("%-8s", "impl");
+	for (l = 0; l < (int)(sizeof(lengths) / sizeof(lengths[0])); l++)
+		printf(" %9d", lengths[l]);
+	printf("   (GB/s by match length)\n");
+
+	for (i = 0; i < count; i++) {
+		printf("%-8s", impls[i]->name);
+		for (l = 0; l < (int)(sizeof(lengths) / sizeof(lengths[0])); l++) {
+			b[lengths[l]] ^= 1;
+			reps = (int)(((int64_t)1 << 30) / (lengths[l] + 16));
+			t = now_ms();
+			for (r = 0; r < reps; r++)
+				sink += impls[i]->matchlen(a, b, BUF_LEN);
+			t = now_ms() - t;
+			b[lengths[l]] ^= 1;
+			printf(" %9.2f", (double)reps * lengths[l] / (t / 1000.0) / 1e9);
+		}
+		printf("\n");
+	}
+
+	printf("%-8s %9s\n", "sub", "GB/s");
+	for (i = 0; i < count; i++) {
+		reps = 1024;
+		t = now_ms();
+		for (r = 0; r < reps; r++)
+			impls[i]->sub(a, a, b, BUF_LEN);
+		t = now_ms() - t;
+		sink += a[r & (BUF_LEN - 1)];
+		printf("%-8s %9.2f\n", impls[i]->name, (double)reps * BUF_LEN / (t / 1000.0) / 1e9);
+	}
+
+	printf("%-8s %9s\n", "add", "GB/s");
+	for (i = 0; i < count; i++) {
+		reps = 1024;
+		t = now_ms();
+		for (r = 0; r < reps; r++)
+			impls[i]->add(a, a, b, BUF_LEN);
+		t = now_ms() - t;
+		sink += a[r & (BUF_LEN - 1)];
+		printf("%-8s %9.2f\n", impls[i]->name, (double)reps * BUF_LEN / (t / 1000.0) / 1e9);
+	}
+
+	printf("%-8s %9s\n", "eqcount", "GB/s");
+	for (i = 0; i < count; i++) {
+		reps = 1024;
+		t = now_ms();
+		for (r = 0; r < reps; r++)
+			sink += impls[i]->eqcount(a, b, BUF_LEN);
+		t = now_ms() - t;
+		printf("%-8s %9.2f\n", impls[i]->name, (double)reps * BUF_LEN / (t / 1000.0) / 1e9);
+	}
+
+	free(a);
+	free(b);
+	return (sink == 0);
+}
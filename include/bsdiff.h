@@ -62,6 +62,7 @@ extern "C" {
 #define BSDIFF_END_OF_FILE      5    /* end of file */
 #define BSDIFF_CORRUPT_PATCH    6    /* corrupt patch data */
 #define BSDIFF_SIZE_TOO_LARGE   7    /* size is too large */
+#define BSDIFF_CANCELED         8    /* canceled by bsdiff_ctx::progress */
 
 /* modes */
 #define BSDIFF_MODE_READ  0
@@ -146,6 +147,23 @@ int bsdiff_open_memory_stream(
 	size_t size,
 	struct bsdiff_stream *stream);
 
+/**
+ * @brief
+ *    Open a read only bsdiff_stream which maps the whole file into memory.
+ *    Its get_buffer callback exposes the mapping, so bsdiff() and bspatch()
+ *    work on the file without copying it.
+ * @param filename
+ *    The file to be mapped.
+ * @param stream
+ *    The stream to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_open_mmap_stream(
+	const char *filename,
+	struct bsdiff_stream *stream);
+
 /**
  * @brief
  *    Close a bsdiff_stream.
@@ -193,11 +211,53 @@ struct bsdiff_patch_packer
 	int (*write_entry_extra)(
 		void *state, const void *buffer, size_t size);
 	int (*flush)(void *state);
+	/* write mode only, optional (may be NULL): sets the level of the codec,
+	   1 (fastest) to 9 (smallest), before write_new_size(). bsdiff() calls
+	   it when bsdiff_ctx::level is set. */
+	int (*set_level)(
+		void *state, int level);
+	/* write mode only, optional (may be NULL): sets the number of threads
+	   compressing each block, before write_new_size(). bsdiff() calls it
+	   when bsdiff_ctx::compress_threads is set. */
+	int (*set_threads)(
+		void *state, int threads);
+	/* read mode only, optional (may be NULL): return in *buffer a pointer to
+	   the next `size` bytes of the diff (extra) of the current entry, valid
+	   until the packer is closed, instead of copying them like
+	   read_entry_diff() (read_entry_extra()). A packer which can't map the
+	   patch returns an error without consuming anything, the caller then
+	   reads the bytes. */
+	int (*map_entry_diff)(
+		void *state, size_t size, const void **buffer);
+	int (*map_entry_extra)(
+		void *state, size_t size, const void **buffer);
+	/* read mode only, optional (may be NULL): the patch is cut into frames,
+	   each rebuilding a range of the new file on its own. After
+	   read_new_size(), read_frame_count() returns their number, and
+	   open_frame() opens a packer in read mode reading the entries of frame
+	   `index` alone. It returns the range [*new_start, *new_end) of the new
+	   file that the frame rebuilds and the position *old_start in the old
+	   file that its first entry starts from. Its read_new_size() returns
+	   the length of the range. Frames opened from a patch stream with
+	   get_buffer are independent and may be read concurrently, otherwise
+	   open_frame() fails. If frame is NULL only the range is returned. */
+	int (*read_frame_count)(
+		void *state, int64_t *count);
+	int (*open_frame)(
+		void *state, int64_t index, struct bsdiff_patch_packer *frame,
+		int64_t *new_start, int64_t *new_end, int64_t *old_start);
 };
 
+/* Codecs of bsdiff_open_frame_patch_packer() */
+#define BSDIFF_CODEC_BZ2   0
+#define BSDIFF_CODEC_ZSTD  1    /* only if the library is built with zstd */
+#define BSDIFF_CODEC_STORE 2
+
 /**
  * @brief
- *    Open a bzip2 bsdiff_patch_packer.
+ *    Open a bzip2 bsdiff_patch_packer, which writes the original BSDIFF40
+ *    format. In read mode, it reads the patches of every codec of this
+ *    library, the codec is detected from the magic of the patch.
  * @param mode
  *    The working mode of the packer.
  * @param stream
@@ -212,6 +272,117 @@ int bsdiff_open_bz2_patch_packer(
 	struct bsdiff_stream *stream,
 	struct bsdiff_patch_packer *packer);
 
+/**
+ * @brief
+ *    Open a zstd bsdiff_patch_packer. The patch has the layout of BSDIFF40
+ *    with the magic "BSZSTD40" and zstd blocks, which decompress several
+ *    times faster than bzip2. In read mode, it reads the patches of every
+ *    codec like the bzip2 packer.
+ * @param mode
+ *    The working mode of the packer.
+ * @param stream
+ *    The stream which managed the reading/writing of the persistent patch data.
+ * @param levels
+ *    The zstd levels of the control, diff and extra blocks, NULL for the
+ *    defaults. set_level() replaces them. Unused in read mode.
+ * @param packer
+ *    The packer to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error, BSDIFF_INVALID_ARG if the library is
+ *    built without zstd (USE_ZSTD), which also can't read zstd patches.
+ */
+BSDIFF_API
+int bsdiff_open_zstd_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	const int levels[3],
+	struct bsdiff_patch_packer *packer);
+
+/**
+ * @brief
+ *    Open a store bsdiff_patch_packer. The patch has the layout of BSDIFF40
+ *    with the magic "BSSTOR40" and uncompressed blocks, for patches which
+ *    stay on the machine. Reading a store patch from a stream with
+ *    get_buffer (mmap or memory), the diff and extra bytes are used in
+ *    place, see map_entry_diff. In read mode, it reads the patches of every
+ *    codec like the bzip2 packer.
+ * @param mode
+ *    The working mode of the packer.
+ * @param stream
+ *    The stream which managed the reading/writing of the persistent patch data.
+ * @param packer
+ *    The packer to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_open_store_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer);
+
+/**
+ * @brief
+ *    Open a framed bsdiff_patch_packer. The patch is cut into frames of
+ *    frame_size bytes of the new file, whose control, diff and extra blocks
+ *    are compressed independently. The entries of bsdiff() are split at the
+ *    frame boundaries. A trailing index gives the offset of every frame in
+ *    the patch and its start position in the old file, so that a range of
+ *    the new file can be rebuilt from its frames alone (bspatch_range()),
+ *    frames can be applied concurrently (bspatch()) and a download can be
+ *    resumed frame by frame. File format:
+ *
+ *	0	8	"BSFRAME1"
+ *	8	8	magic of the codec of the blocks ("BSDIFF40", "BSZSTD40", "BSSTOR40")
+ *	16	8	sizeof(newfile)
+ *	24	8	F, the frame size
+ *	32	8	I, offset of the index
+ *	40	...	frames: codec(control block) codec(diff block) codec(extra block)
+ *	I	40*N	for each of the N = ceil(sizeof(newfile) / F) frames: the old
+ *			position, the offset of the frame and the lengths of its
+ *			three blocks
+ *
+ *    Numbers are encoded like those of BSDIFF40. Frame k rebuilds the new
+ *    file from k*F to (k+1)*F.
+ * @param mode
+ *    The working mode of the packer.
+ * @param stream
+ *    The stream which managed the reading/writing of the persistent patch data.
+ * @param codec
+ *    The codec of the frames, one of BSDIFF_CODEC_*. Unused in read mode.
+ * @param frame_size
+ *    The frame size in bytes of the new file, 0 selects the default (1 MiB).
+ *    Smaller frames give finer random access and larger patches. Unused in
+ *    read mode.
+ * @param packer
+ *    The packer to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error, BSDIFF_INVALID_ARG if the codec isn't built.
+ */
+BSDIFF_API
+int bsdiff_open_frame_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	int codec,
+	int64_t frame_size,
+	struct bsdiff_patch_packer *packer);
+
+/**
+ * @brief
+ *    Open a packer in read mode for a patch of any format of this library,
+ *    framed or not, detected from its magic.
+ * @param stream
+ *    The stream of the patch.
+ * @param packer
+ *    The packer to be opened.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_open_patch_reader(
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer);
+
 /**
  * @brief
  *    Close a bsdiff_patch_packer.
@@ -223,13 +394,111 @@ void bsdiff_close_patch_packer(
 	struct bsdiff_patch_packer *packer);
 
 
+/* Phases of bsdiff() reported to bsdiff_ctx::progress */
+#define BSDIFF_PHASE_INDEX 0    /* indexing the old file, done/total bytes of old */
+#define BSDIFF_PHASE_SCAN  1    /* scanning the new file, done/total bytes of new */
+#define BSDIFF_PHASE_FLUSH 2    /* compressing and writing the patch */
+
+/* Match engines of bsdiff(), see bsdiff_ctx::match_engine */
+#define BSDIFF_ENGINE_SA   0    /* suffix array (default) */
+#define BSDIFF_ENGINE_HASH 1    /* hash chains, faster but larger patches */
+
 /**
- * @brief Some user-defined callbacks.
+ * @brief Some user-defined callbacks and tuning parameters.
+ *
+ * A zero-initialized context selects the default behavior.
  */
 struct bsdiff_ctx
 {
 	void *opaque;
 	void (*log_error)(void *opaque, const char *errmsg);
+	/* Number of threads used to construct the suffix array of the old file.
+	   0 or 1 means single-threaded. Only effective when the library is built
+	   with OpenMP (USE_OPENMP), the generated patch is identical either way.
+	   It is also the number of workers of bsdiff_multi(), and of bspatch()
+	   applying the frames of a framed patch. */
+	int num_threads;
+	/* Length of the prefixes indexed by the bucket table, which narrows the
+	   initial interval of every suffix array search. 0 selects the default
+	   (2, a table of 64K entries), 1..3 are valid, a negative value disables
+	   the table. Memory is (256^k + 1) * 4 bytes (8 for inputs >= 2 GiB). */
+	int bucket_bytes;
+	/* Number of partitions of the new file which are scanned concurrently,
+	   each on its own thread. 0 or 1 means a single serial scan. Partitions
+	   are at least 64 KiB. Matches can't cross a partition boundary, so the
+	   patch is slightly larger than the serial one (typically < 1%). */
+	int scan_partitions;
+	/* Directory of the suffix array cache, NULL disables it. The suffix array
+	   of the old file is stored there, named after a hash of its content, and
+	   later diffs against the same old file map it instead of rebuilding it.
+	   Stale or corrupt cache files are detected and rewritten. */
+	const char *sa_cache_dir;
+	/* Memory budget of bsdiff() in bytes, 0 means unlimited. It covers the
+	   index of the old file as configured (suffix array, sparse suffix array
+	   or hash chains, bucket table, inverse suffix array) and the copies of
+	   the inputs which don't implement get_buffer, not the packer. When the
+	   whole old file can't be indexed within it, old and new are diffed in
+	   windows with an index of the old window only, which makes the
+	   (standard) patch somewhat larger. Each window is indexed by a full
+	   suffix array built anew and scanned serially: match_engine,
+	   sa_sample_rate, sa_cache_dir, scan_partitions and successor_search
+	   don't apply to the windowed diff. */
+	int64_t memory_budget;
+	/* Index only every k-th suffix of the old file (k >= 2), 0 or 1 indexes
+	   all of them. The index takes 4/k bytes per byte of old (8/k while it
+	   is built) instead of 4, and every search becomes k searches whose
+	   matches are verified and extended in old: slower, and the patch is
+	   somewhat larger. The bucket table and the suffix array cache are not
+	   used in this mode. */
+	int sa_sample_rate;
+	/* How matches are found in the old file, one of BSDIFF_ENGINE_*. The hash
+	   engine chains the positions of old by the hash of their first 8 bytes
+	   and checks the 16 most recent candidates. It is several times faster
+	   and gives somewhat larger patches. The settings of the suffix array
+	   (bucket_bytes, sa_cache_dir, sa_sample_rate) don't apply to it, and
+	   the windowed diff of memory_budget always uses suffix arrays. */
+	int match_engine;
+	/* Minimum length of a run of equal bytes at the current alignment of old
+	   and new that the scan skips in one step, taking it as the match instead
+	   of searching the index, 0 disables it. It mostly helps with large,
+	   nearly identical files (e.g. 4096). A longer match elsewhere in old is
+	   then missed, so the patch may differ slightly from the default one. */
+	int64_t fast_forward;
+	/* Non-zero keeps the inverse of the suffix array, so that the search of
+	   the next position inside a match starts from the rank of the successor
+	   of that match in old and takes a few steps instead of log2(oldsize).
+	   It takes as much memory as the suffix array again and is only used
+	   with a full suffix array, not by the windowed diff. */
+	int successor_search;
+	/* Optional progress callback, called at the start and the end of every
+	   phase (BSDIFF_PHASE_*) and every progress_interval bytes of the scan.
+	   Returning non-zero cancels the diff, which then fails with
+	   BSDIFF_CANCELED. bsdiff_multi() calls it from its workers, for every
+	   target, and cancels all of them. The windowed diff reports its windows
+	   as a single scan. */
+	int (*progress)(void *opaque, int phase, int64_t done, int64_t total);
+	/* Bytes of the new file scanned between two progress calls, 0 selects
+	   the default (1 MiB). */
+	int64_t progress_interval;
+	/* Wall-clock budget of the diff in milliseconds, from the call of
+	   bsdiff(), 0 means unlimited. When it runs out, the scan only searches
+	   every 64th position of the rest of the new file, which is much faster
+	   but makes a larger patch. The index of the old file (every window of
+	   the windowed diff) is always built in full. */
+	int64_t time_budget_ms;
+	/* Speed/size preset, 1 (fastest) to 9 (smallest patch), 0 selects the
+	   default, which is level 9 with the packer's default codec settings.
+	   Lower levels search only every 2nd to 16th position of the new file
+	   and enable fast_forward (unless it is set, a negative value disables
+	   it), level 1 also passes the fastest level to the packer's
+	   set_level(). Other values are taken as 9. */
+	int level;
+	/* Number of threads compressing each block of the patch, passed to the
+	   packer's set_threads(). 0 or 1 keeps the standard format. The bz2
+	   packer then cuts every block into bzip2 blocks compressed as
+	   independent streams, which the bspatch() of this library and bzip2
+	   read, but not the bspatch of the original bsdiff. */
+	int compress_threads;
 };
 
 /**
@@ -253,6 +522,38 @@ int bsdiff(
 	struct bsdiff_stream *newfile, 
 	struct bsdiff_patch_packer *packer);
 
+/** @brief A new file and the packer of its patch, see bsdiff_multi(). */
+struct bsdiff_target
+{
+	struct bsdiff_stream *newfile;
+	struct bsdiff_patch_packer *packer;
+	int ret;   /* result of this target, set by bsdiff_multi() */
+};
+
+/**
+ * @brief
+ *    Generate the patches between an old file and several new files.
+ *    The old file is loaded and indexed once, then the patches are generated
+ *    concurrently by ctx->num_threads workers. Each patch is identical to
+ *    the one bsdiff() would generate. log_error may be called concurrently.
+ * @param ctx
+ *    The context.
+ * @param oldfile
+ *    The stream of the old file.
+ * @param targets
+ *    The new files and their packers, the result of each is set in its ret.
+ * @param count
+ *    The number of targets.
+ * @return
+ *    BSDIFF_SUCCESS if no error, otherwise the first error.
+ */
+BSDIFF_API
+int bsdiff_multi(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *oldfile,
+	struct bsdiff_target *targets,
+	int count);
+
 /**
  * @brief
  *    Apply the patch to the old file, re-create the new file.
@@ -274,6 +575,105 @@ int bspatch(
 	struct bsdiff_stream *newfile,
 	struct bsdiff_patch_packer *packer);
 
+/**
+ * @brief
+ *    Rebuild a range of the new file from a framed patch, decoding only the
+ *    frames which overlap it (see bsdiff_open_frame_patch_packer()).
+ * @param ctx
+ *    The context.
+ * @param oldfile
+ *    The stream of the old file.
+ * @param packer
+ *    The packer, in read mode, which must implement open_frame().
+ * @param offset
+ *    The start of the range in the new file.
+ * @param buffer
+ *    Receives the bytes of the range.
+ * @param size
+ *    The length of the range, which must be within the new file.
+ * @return
+ *    BSDIFF_SUCCESS if no error, BSDIFF_INVALID_ARG if the patch isn't
+ *    framed, its stream has no get_buffer, or the range is out of the new file.
+ */
+BSDIFF_API
+int bspatch_range(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *oldfile,
+	struct bsdiff_patch_packer *packer,
+	int64_t offset,
+	void *buffer,
+	size_t size);
+
+/**
+ * @brief
+ *    Generate a bzip2 patch between two buffers in one call.
+ *    The buffers are used in place, no copy of them is made.
+ * @param ctx
+ *    The context.
+ * @param old
+ *    The old data.
+ * @param oldsize
+ *    The size of the old data.
+ * @param new
+ *    The new data.
+ * @param newsize
+ *    The size of the new data.
+ * @param patch
+ *    Receives the patch, which should be released with bsdiff_free().
+ * @param patchsize
+ *    Receives the size of the patch.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bsdiff_buffers(
+	struct bsdiff_ctx *ctx,
+	const void *old,
+	size_t oldsize,
+	const void *new,
+	size_t newsize,
+	void **patch,
+	size_t *patchsize);
+
+/**
+ * @brief
+ *    Apply a patch of any format to a buffer in one call.
+ *    The buffers are used in place, no copy of them is made.
+ * @param ctx
+ *    The context.
+ * @param old
+ *    The old data.
+ * @param oldsize
+ *    The size of the old data.
+ * @param patch
+ *    The patch.
+ * @param patchsize
+ *    The size of the patch.
+ * @param new
+ *    Receives the new data, which should be released with bsdiff_free().
+ * @param newsize
+ *    Receives the size of the new data.
+ * @return
+ *    BSDIFF_SUCCESS if no error.
+ */
+BSDIFF_API
+int bspatch_buffers(
+	struct bsdiff_ctx *ctx,
+	const void *old,
+	size_t oldsize,
+	const void *patch,
+	size_t patchsize,
+	void **new,
+	size_t *newsize);
+
+/**
+ * @brief
+ *    Release a buffer returned by bsdiff_buffers() or bspatch_buffers().
+ */
+BSDIFF_API
+void bsdiff_free(
+	void *buffer);
+
 #ifdef __cplusplus
 }
 #endif
@@ -35,182 +35,699 @@
 #include <bzlib.h>
 #include <divsufsort.h>
 #include <divsufsort64.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "bsdiff.h"
 #include "bsdiff_private.h"
 
 #define DB_BUF_LEN 65536
+#define MIN_PARTITION_LEN 65536
+#define MIN_WINDOW_LEN 65536
+#define PROGRESS_INTERVAL (1 << 20)
+#define EXPIRED_STRIDE 64
+#define SCORE_BLOCK_LEN 64
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#define MAX(x,y) (((x)>(y)) ? (x) : (y))
 
-static int64_t matchlen(uint8_t *old, int64_t oldsize, uint8_t *new, int64_t newsize)
+#define MATCHLEN_INLINE 16
+
+static inline int64_t matchlen(const uint8_t *old, int64_t oldsize, const uint8_t *new, int64_t newsize)
 {
-	int64_t i;
+	int64_t i, n = MIN(oldsize, newsize);
 
-	for (i = 0; (i < oldsize) && (i < newsize); i++) {
+	/* Most probes of a search mismatch within a few bytes, which is
+	   cheaper to find inline than through the dispatched SIMD kernel. */
+	for (i = 0; (i < n) && (i < MATCHLEN_INLINE); i++) {
 		if (old[i] != new[i])
-			break;
+			return i;
 	}
-	return i;
+	if (i == n)
+		return n;
+	return i + bsdiff_matchlen(old + i, new + i, n - i);
 }
 
-static int64_t search32(uint8_t *buf, uint8_t *old, int64_t oldsize,
-		uint8_t *new, int64_t newsize, int64_t st, int64_t en, int64_t *pos)
+/*
+ * Suffix arrays hold 4-byte entries below 2 GiB. Larger inputs use packed
+ * 5-byte (40-bit little-endian) entries up to 1 TiB and 8-byte ones beyond,
+ * which divsufsort64() produces and construct_sa() packs afterwards.
+ */
+#ifndef SA40_MIN_SIZE
+#define SA40_MIN_SIZE 0x7fffffff
+#endif
+#define SA40_MAX_SIZE ((int64_t)1 << 40)
+
+static int sa_width(int64_t oldsize)
 {
-	int64_t x, y;
-	int32_t *SA = (int32_t*)buf;
+	if (oldsize < SA40_MIN_SIZE)
+		return 4;
+	return (oldsize < SA40_MAX_SIZE) ? 5 : 8;
+}
 
-	if (en-st < 2) {
-		x = matchlen(old+SA[st], oldsize-SA[st], new, newsize);
-		y = matchlen(old+SA[en], oldsize-SA[en], new, newsize);
+/* Width of the suffix array built by divsufsort() / divsufsort64() */
+static int sa_native_width(int64_t oldsize)
+{
+	return (oldsize < 0x7fffffff) ? 4 : 8;
+}
 
-		if (x > y) {
-			*pos = SA[st];
-			return x;
-		} else {
-			*pos = SA[en];
-			return y;
-		}
-	};
+/* Returns the i-th entry of a suffix array with `width` bytes per entry. */
+static inline int64_t sa_get(const uint8_t *SA, int width, int64_t i)
+{
+	const uint8_t *p;
+
+	if (width == 4)
+		return ((const int32_t*)SA)[i];
+	if (width == 5) {
+		p = SA + i * 5;
+		return (int64_t)p[0] | ((int64_t)p[1] << 8) | ((int64_t)p[2] << 16) |
+			((int64_t)p[3] << 24) | ((int64_t)p[4] << 32);
+	}
+	return ((const int64_t*)SA)[i];
+}
 
-	x = st+(en-st)/2;
-	if (memcmp(old+SA[x], new, (size_t)MIN(oldsize-SA[x], newsize)) < 0) {
-		return search32(buf, old, oldsize, new, newsize, x, en, pos);
+static inline void sa_set(uint8_t *SA, int width, int64_t i, int64_t v)
+{
+	uint8_t *p;
+
+	if (width == 4) {
+		((int32_t*)SA)[i] = (int32_t)v;
+	} else if (width == 5) {
+		p = SA + i * 5;
+		p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16);
+		p[3] = (uint8_t)(v >> 24); p[4] = (uint8_t)(v >> 32);
 	} else {
-		return search32(buf, old, oldsize, new, newsize, st, x, pos);
-	};
+		((int64_t*)SA)[i] = v;
+	}
 }
 
-static int64_t search64(uint8_t *buf, uint8_t *old, int64_t oldsize,
-		uint8_t *new, int64_t newsize, int64_t st, int64_t en, int64_t *pos)
+/* Index of the old file */
+struct sa_index
+{
+	const uint8_t *old;
+	int64_t oldsize;
+	const uint8_t *SA; /* nsa+1 entries, SA[0] is the empty suffix */
+	int64_t nsa;       /* oldsize, or the number of sampled suffixes */
+	int sample;        /* every sample-th suffix is in SA, 1 for a full SA */
+	int width;         /* bytes per SA entry: 4, 5 or 8 */
+	uint8_t *bucket;   /* (1 << (8*bucket_bytes)) + 1 entries of `width` bytes, or NULL */
+	int bucket_bytes;
+	int nshort;        /* SA indices of the suffixes shorter than bucket_bytes */
+	int64_t shorts[3];
+	uint8_t *head;     /* hash engine: (1 << hash_bits) entries of `width` bytes, or NULL */
+	uint8_t *chain;    /* hash engine: oldsize entries of `width` bytes */
+	int hash_bits;
+	uint8_t *ISA;      /* successor search: SA index of every suffix, oldsize+1 entries, or NULL */
+};
+
+/* SA interval known from the bucket table, see index_search() */
+struct sa_bucket_range
+{
+	int64_t lo;        /* suffixes before lo are less than the pattern */
+	int64_t hi;        /* suffixes from hi on are not less than the pattern */
+	int64_t lcp;       /* suffixes in [lo, hi) share lcp bytes with the pattern */
+};
+
+static int is_short_suffix(const struct sa_index *idx, int64_t x)
 {
-	int64_t x, y;
-	int64_t *SA = (int64_t*)buf;
+	int i;
+	for (i = 0; i < idx->nshort; i++) {
+		if (idx->shorts[i] == x)
+			return 1;
+	}
+	return 0;
+}
 
-	if (en-st < 2) {
-		x = matchlen(old+SA[st], oldsize-SA[st], new, newsize);
-		y = matchlen(old+SA[en], oldsize-SA[en], new, newsize);
+/*
+ * Binary search for the suffix of old which has the longest common prefix
+ * with new, in SA[st..en].
+ *
+ * Iterative form of the original recursive search, with the mlr
+ * acceleration of Manber and Myers: lcp_st/lcp_en are lower bounds of the
+ * common prefix of new with the suffixes at st/en. Every suffix in between
+ * shares at least min(lcp_st, lcp_en) bytes with new, so each probe starts
+ * comparing from there instead of from offset 0. The comparisons decide
+ * exactly like the memcmp() of the original, so the result is identical.
+ *
+ * If `range` is not NULL, probes outside of it are decided without
+ * touching old or the suffix array.
+ */
+static int64_t search(const struct sa_index *idx, const struct sa_bucket_range *range,
+		const uint8_t *new, int64_t newsize, int64_t st, int64_t en,
+		int64_t lcp_st, int64_t lcp_en, int64_t *pos)
+{
+	const uint8_t *old = idx->old;
+	int64_t oldsize = idx->oldsize;
+	int64_t x, y, p, n, lcp;
 
-		if (x > y) {
-			*pos = SA[st];
-			return x;
+	while (en - st >= 2) {
+		x = st + (en - st) / 2;
+		if (range != NULL && (x < range->lo || x >= range->hi) && !is_short_suffix(idx, x)) {
+			/* differs from new within the bucket prefix */
+			if (x < range->lo) {
+				st = x;
+				lcp_st = 0;
+			} else {
+				en = x;
+				lcp_en = 0;
+			}
+			continue;
+		}
+		p = sa_get(idx->SA, idx->width, x);
+		n = MIN(oldsize - p, newsize);
+		lcp = MIN(lcp_st, lcp_en);
+		if (range != NULL && x >= range->lo && x < range->hi && !is_short_suffix(idx, x))
+			lcp = range->lcp > lcp ? range->lcp : lcp;
+		lcp += matchlen(old + p + lcp, n - lcp, new + lcp, n - lcp);
+		if ((lcp < n) && (old[p + lcp] < new[lcp])) {
+			st = x;
+			lcp_st = lcp;
 		} else {
-			*pos = SA[en];
-			return y;
+			en = x;
+			lcp_en = lcp;
 		}
-	};
+	}
 
-	x = st+(en-st)/2;
-	if (memcmp(old+SA[x], new, (size_t)MIN(oldsize-SA[x], newsize)) < 0) {
-		return search64(buf, old, oldsize, new, newsize, x, en, pos);
+	p = sa_get(idx->SA, idx->width, st);
+	x = lcp_st + matchlen(old + p + lcp_st, oldsize - p - lcp_st, new + lcp_st, newsize - lcp_st);
+	p = sa_get(idx->SA, idx->width, en);
+	y = lcp_en + matchlen(old + p + lcp_en, oldsize - p - lcp_en, new + lcp_en, newsize - lcp_en);
+
+	if (x > y) {
+		*pos = sa_get(idx->SA, idx->width, st);
+		return x;
 	} else {
-		return search64(buf, old, oldsize, new, newsize, st, x, pos);
-	};
+		*pos = sa_get(idx->SA, idx->width, en);
+		return y;
+	}
 }
 
-int bsdiff(
-	struct bsdiff_ctx *ctx,
-	struct bsdiff_stream *oldfile, 
-	struct bsdiff_stream *newfile, 
-	struct bsdiff_patch_packer *packer)
+/*
+ * Build the bucket table: bucket[K] is the index in SA of the first suffix
+ * whose first k bytes are >= K (read as a big-endian number), so the
+ * suffixes starting with K are in SA[bucket[K]..bucket[K+1]).
+ *
+ * It is computed by counting the k-byte prefixes of old, which reads old
+ * sequentially instead of dereferencing every SA entry. The k-1 suffixes
+ * shorter than k bytes sort right before the first suffix that starts
+ * with their zero-padded bytes, and SA[0] is the empty suffix.
+ */
+static int build_bucket(struct sa_index *idx, int k)
 {
-	int ret;
-	uint8_t *old = NULL, *new = NULL;
-	int64_t oldsize, newsize;
-	int64_t scan, pos, len;
-	int64_t lastscan, lastpos, lastoffset;
-	int64_t oldscore, scsc;
-	int64_t s, Sf, lenf, Sb, lenb;
-	int64_t overlap, Ss, lens;
-	int64_t i, j;
-	int64_t dblen;
-	uint8_t *db = NULL;
-	size_t cb;
-	int64_t (*psearch)(uint8_t*, uint8_t*, int64_t, uint8_t*, 
-		int64_t, int64_t, int64_t, int64_t*);
-	int64_t bufsize;
-	uint8_t *SA = NULL;
+	const uint8_t *old = idx->old;
+	int64_t oldsize = idx->oldsize;
+	int64_t nb = (int64_t)1 << (8 * k);
+	int64_t p, K, v, x;
+	int i;
 
-	assert(oldfile->get_mode(oldfile->state) == BSDIFF_MODE_READ);
-	assert(newfile->get_mode(newfile->state) == BSDIFF_MODE_READ);
-	assert(packer->get_mode(packer->state) == BSDIFF_MODE_WRITE);
+	idx->bucket = calloc((size_t)(nb + 1), (size_t)idx->width);
+	if (idx->bucket == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	idx->bucket_bytes = k;
 
-	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	if ((oldfile->seek(oldfile->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
-		(oldfile->tell(oldfile->state, &oldsize) != BSDIFF_SUCCESS) ||
-		(oldfile->seek(oldfile->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS))
-	{
-		HANDLE_ERROR(BSDIFF_FILE_ERROR, "retrieve size of oldfile");
+	/* count[K] is accumulated in bucket[K+1] */
+	sa_set(idx->bucket, idx->width, 0, 1);
+	for (p = 0, K = 0; p < oldsize; p++) {
+		K = ((K << 8) | old[p]) & (nb - 1);
+		if (p >= k - 1) {
+			v = sa_get(idx->bucket, idx->width, K + 1);
+			sa_set(idx->bucket, idx->width, K + 1, v + 1);
+		}
+	}
+	/* suffixes shorter than k */
+	for (p = (oldsize > k - 1) ? oldsize - (k - 1) : 0; p < oldsize; p++) {
+		for (K = 0, i = 0; i < k; i++)
+			K = (K << 8) | ((p + i < oldsize) ? old[p + i] : 0);
+		v = sa_get(idx->bucket, idx->width, K);
+		sa_set(idx->bucket, idx->width, K, v + 1);
+	}
+	/* prefix sum */
+	for (K = 1; K <= nb; K++) {
+		v = sa_get(idx->bucket, idx->width, K - 1) + sa_get(idx->bucket, idx->width, K);
+		sa_set(idx->bucket, idx->width, K, v);
 	}
-	if (oldsize >= SIZE_MAX)
-		HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "oldfile is too large");
-	if ((old = malloc((size_t)(oldsize + 1))) == NULL)
-		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for old");
-	if (oldfile->read(oldfile->state, old, (size_t)oldsize, &cb) != BSDIFF_SUCCESS)
-		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read oldfile");
+	assert(sa_get(idx->bucket, idx->width, nb) == oldsize + 1);
 
-	/* Construct the suffix array */
-	bufsize = (oldsize + 1) * sizeof(int64_t);
-	if (oldsize < 0x7fffffff)
-		bufsize /= 2;
-	if (bufsize < SIZE_MAX)
-		SA = malloc((size_t)bufsize);
-	if (SA == NULL)
-		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for SA");
+	/* locate the short suffixes, each one is within k-1 entries before its bucket */
+	idx->nshort = 0;
+	for (p = (oldsize > k - 1) ? oldsize - (k - 1) : 0; p < oldsize; p++) {
+		for (K = 0, i = 0; i < k; i++)
+			K = (K << 8) | ((p + i < oldsize) ? old[p + i] : 0);
+		for (x = sa_get(idx->bucket, idx->width, K) - 1; x > 0; x--) {
+			if (sa_get(idx->SA, idx->width, x) == p) {
+				idx->shorts[idx->nshort++] = x;
+				break;
+			}
+		}
+	}
+	assert(idx->nshort == MIN(oldsize, k - 1));
+
+	return BSDIFF_SUCCESS;
+}
+
+/*
+ * Hash chain engine: every position of old is chained by the hash of its
+ * first HASH_MIN_MATCH bytes. Positions are stored plus one, 0 ends a chain.
+ * A search verifies the HASH_CHAIN_DEPTH most recent candidates and keeps
+ * the longest match, which is much faster than the suffix array search but
+ * misses matches shorter than HASH_MIN_MATCH and candidates deeper in the
+ * chain, so patches are somewhat larger.
+ */
+#define HASH_MIN_MATCH 8
+#define HASH_CHAIN_DEPTH 16
+
+static inline uint64_t hash_bytes(const uint8_t *p, int bits)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 0x9E3779B185EBCA87ULL) >> (64 - bits);
+}
+
+static int build_hash_chains(struct sa_index *idx)
+{
+	const uint8_t *old = idx->old;
+	int64_t p, h;
+
+	idx->hash_bits = 16;
+	while (idx->hash_bits < 26 && ((int64_t)1 << idx->hash_bits) < idx->oldsize)
+		idx->hash_bits++;
+	idx->head = calloc((size_t)1 << idx->hash_bits, (size_t)idx->width);
+	idx->chain = malloc((size_t)(idx->oldsize + 1) * (size_t)idx->width);
+	if (idx->head == NULL || idx->chain == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+
+	for (p = 0; p + HASH_MIN_MATCH <= idx->oldsize; p++) {
+		h = (int64_t)hash_bytes(old + p, idx->hash_bits);
+		sa_set(idx->chain, idx->width, p, sa_get(idx->head, idx->width, h));
+		sa_set(idx->head, idx->width, h, p + 1);
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int64_t hash_search(const struct sa_index *idx,
+		const uint8_t *new, int64_t newsize, int64_t *pos)
+{
+	int64_t p, len, best = 0;
+	int depth;
+
+	*pos = 0;
+	if (newsize < HASH_MIN_MATCH)
+		return 0;
+
+	p = sa_get(idx->head, idx->width, (int64_t)hash_bytes(new, idx->hash_bits));
+	for (depth = 0; p != 0 && depth < HASH_CHAIN_DEPTH; depth++) {
+		len = matchlen(idx->old + p - 1, idx->oldsize - p + 1, new, newsize);
+		if (len > best) {
+			best = len;
+			*pos = p - 1;
+			if (len == newsize)
+				break;
+		}
+		p = sa_get(idx->chain, idx->width, p - 1);
+	}
+
+	return best;
+}
+
+/*
+ * Find a long match of new in old with a sparse suffix array.
+ *
+ * A match at p of at least `sample` bytes contains a sampled suffix at
+ * p+j for some j < sample, so new+j is searched for every such j, and the
+ * match is verified and extended from q-j for the suffix q found.
+ */
+static int64_t sparse_search(const struct sa_index *idx,
+		const uint8_t *new, int64_t newsize, int64_t *pos)
+{
+	int64_t j, q, p, len, best = 0;
+
+	*pos = 0;
+	for (j = 0; j < idx->sample && j < newsize; j++) {
+		len = search(idx, NULL, new + j, newsize - j, 0, idx->nsa, 0, 0, &q);
+		if (q < j || (len == 0 && j > 0))
+			continue;
+		p = q - j;
+		len = matchlen(idx->old + p, idx->oldsize - p, new, newsize);
+		if (len > best || j == 0) {
+			best = len;
+			*pos = p;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Find the longest match of new in old.
+ *
+ * The suffixes sharing the first k bytes of new are SA[lo..hi) from the
+ * bucket table, and all others are decided by those k bytes alone. The
+ * search still takes the same steps from [0, oldsize] as without the
+ * table, which keeps the patch identical, but only probes within [lo, hi)
+ * read old and the suffix array. The only exceptions are the k-1 short
+ * suffixes at the end of old, which can be a prefix of new.
+ */
+static int64_t index_search(const struct sa_index *idx,
+		const uint8_t *new, int64_t newsize, int64_t *pos)
+{
+	struct sa_bucket_range range;
+	int64_t K;
+	int i;
+
+	if (idx->head != NULL)
+		return hash_search(idx, new, newsize, pos);
+	if (idx->sample > 1)
+		return sparse_search(idx, new, newsize, pos);
+
+	if (idx->bucket != NULL && newsize >= idx->bucket_bytes) {
+		for (K = 0, i = 0; i < idx->bucket_bytes; i++)
+			K = (K << 8) | new[i];
+		range.lo = sa_get(idx->bucket, idx->width, K);
+		range.hi = sa_get(idx->bucket, idx->width, K + 1);
+		range.lcp = idx->bucket_bytes;
+		return search(idx, &range, new, newsize, 0, idx->nsa, 0, 0, pos);
+	}
+
+	return search(idx, NULL, new, newsize, 0, idx->nsa, 0, 0, pos);
+}
+
+/* Whether search() takes suffix SA[x] as less than new, its lcp with new
+   (at least `known`) goes to *lcp */
+static int suffix_less(const struct sa_index *idx, int64_t x,
+		const uint8_t *new, int64_t newsize, int64_t known, int64_t *lcp)
+{
+	int64_t p = sa_get(idx->SA, idx->width, x);
+	int64_t n = MIN(idx->oldsize - p, newsize);
+
+	*lcp = known + matchlen(idx->old + p + known, n - known, new + known, n - known);
+	return (*lcp < n) && (idx->old[p + *lcp] < new[*lcp]);
+}
+
+/*
+ * Search seeded with the SA index r of a suffix which matches new for at
+ * least lcp_r bytes, typically the successor of the previous match. It
+ * gallops from r to an interval around new and bisects it like search(),
+ * which takes a few steps instead of log2(oldsize) while a match continues.
+ * The result is the same as the one of index_search(), except when suffixes
+ * at the end of old are a prefix of new: search() takes them as greater than
+ * new, which breaks the order of the suffix array, and the two searches may
+ * then end at different matches.
+ */
+static int64_t successor_search(const struct sa_index *idx,
+		const uint8_t *new, int64_t newsize, int64_t r, int64_t lcp_r, int64_t *pos)
+{
+	int64_t lo, hi, lcp_lo, lcp_hi, x, lcp = 0, step;
+
+	/* Gallop to lo < hi with SA[lo] < new <= SA[hi]. As in search(), SA[0]
+	   (the empty suffix) and SA[nsa] are not compared. */
+	if (r > 0 && (r == idx->nsa || !suffix_less(idx, r, new, newsize, lcp_r, &lcp))) {
+		hi = r;
+		lcp_hi = (r == idx->nsa) ? 0 : lcp;
+		for (step = 1; ; step *= 2) {
+			x = hi - step;
+			if (x <= 0) {
+				lo = 0;
+				lcp_lo = 0;
+				break;
+			}
+			if (suffix_less(idx, x, new, newsize, 0, &lcp)) {
+				lo = x;
+				lcp_lo = lcp;
+				break;
+			}
+			hi = x;
+			lcp_hi = lcp;
+		}
+	} else {
+		lo = r;
+		lcp_lo = (r == 0) ? 0 : lcp;
+		for (step = 1; ; step *= 2) {
+			x = lo + step;
+			if (x >= idx->nsa) {
+				hi = idx->nsa;
+				lcp_hi = 0;
+				break;
+			}
+			if (!suffix_less(idx, x, new, newsize, 0, &lcp)) {
+				hi = x;
+				lcp_hi = lcp;
+				break;
+			}
+			lo = x;
+			lcp_lo = lcp;
+		}
+	}
+
+	return search(idx, NULL, new, newsize, lo, hi, lcp_lo, lcp_hi, pos);
+}
+
+/*
+ * Builds the suffix array of old into SA, with `width` bytes per entry. SA
+ * must hold oldsize+1 entries of MAX(width, sa_native_width(oldsize)) bytes.
+ */
+static int construct_sa(const uint8_t *old, int64_t oldsize, uint8_t *SA, int width, int num_threads)
+{
+	int ret;
+	int native = sa_native_width(oldsize);
+	int64_t i;
+#ifdef _OPENMP
+	int max_threads;
+
+	/* libdivsufsort sorts the type B* substrings in parallel with
+	   omp_get_max_threads() workers. The setting is per-thread, so it is
+	   safe to change it around the call and restore it afterwards. */
+	max_threads = omp_get_max_threads();
+	omp_set_num_threads((num_threads > 1) ? num_threads : 1);
+#else
+	(void)num_threads;
+#endif
 
 	if (oldsize < 0x7fffffff)
 	{
 		((int32_t*)SA)[0] = (int32_t)oldsize;
-		if (divsufsort(old, ((int32_t*)SA) + 1, (int32_t)oldsize) != 0)
-			HANDLE_ERROR(BSDIFF_ERROR, "construct suffix array");
-		psearch = search32;
+		ret = divsufsort(old, ((int32_t*)SA) + 1, (int32_t)oldsize);
 	}
 	else
 	{
 		((int64_t*)SA)[0] = (int64_t)oldsize;
-		if (divsufsort64(old, ((int64_t*)SA) + 1, (int64_t)oldsize) != 0)
-			HANDLE_ERROR(BSDIFF_ERROR, "construct suffix array");
-		psearch = search64;
+		ret = divsufsort64(old, ((int64_t*)SA) + 1, (int64_t)oldsize);
 	}
 
-	/* Allocate newsize+1 bytes instead of newsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	if ((newfile->seek(newfile->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
-		(newfile->tell(newfile->state, &newsize) != BSDIFF_SUCCESS) ||
-		(newfile->seek(newfile->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS))
-	{
-		HANDLE_ERROR(BSDIFF_FILE_ERROR, "retrieve size of newfile");
+#ifdef _OPENMP
+	omp_set_num_threads(max_threads);
+#endif
+
+	if (ret != 0)
+		return BSDIFF_ERROR;
+
+	/* Repack in place, front to back when shrinking, back to front when growing */
+	if (width < native) {
+		for (i = 0; i <= oldsize; i++)
+			sa_set(SA, width, i, sa_get(SA, native, i));
+	} else if (width > native) {
+		for (i = oldsize; i >= 0; i--)
+			sa_set(SA, width, i, sa_get(SA, native, i));
 	}
-	if (newsize >= SIZE_MAX)
-		HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "newfile is too large");
-	if ((new = malloc((size_t)(newsize + 1))) == NULL)
-		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for new");
-	if (newfile->read(newfile->state, new, (size_t)newsize, &cb) != BSDIFF_SUCCESS)
-		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read newfile");
 
-	if ((db = malloc(DB_BUF_LEN)) == NULL)
-		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for db");
+	return BSDIFF_SUCCESS;
+}
 
-	/* Begin write */
-	if (packer->write_new_size(packer->state, newsize) != BSDIFF_SUCCESS)
-		HANDLE_ERROR(BSDIFF_FILE_ERROR, "write new size");
+/* An entry of the patch, see bsdiff_patch_packer */
+struct diff_entry
+{
+	int64_t newpos;    /* start of the entry in new */
+	int64_t oldpos;    /* start of the diff data in old */
+	int64_t diff;      /* length of the diff data */
+	int64_t extra;     /* length of the extra data */
+	int64_t seek;      /* seek in old after the diff data */
+};
 
-	/* Scan */
-	scan = 0; len = 0;
-	lastscan = 0; lastpos = 0; lastoffset = 0;
-	while (scan < newsize) {
+/*
+ * Presets of bsdiff_ctx::level, 1 (fastest) to 9. Level 9 is the original
+ * bsdiff, which searches every position. Taking a match earlier than the
+ * "len > oldscore + 8" of the original (or later) makes the patch larger
+ * without saving time, so the levels only change how many positions are
+ * searched.
+ */
+struct level_preset
+{
+	int stride;            /* search every stride-th position of new */
+	int64_t fast_forward;  /* default of bsdiff_ctx::fast_forward */
+	int codec_level;       /* passed to bsdiff_patch_packer::set_level */
+};
+
+static const struct level_preset level_presets[9] = {
+	{ 16,  4096, 1 },  /* 1 */
+	{ 16,  4096, 9 },  /* 2 */
+	{  8,  4096, 9 },  /* 3 */
+	{  4,  4096, 9 },  /* 4 */
+	{  3,  4096, 9 },  /* 5 */
+	{  2,  4096, 9 },  /* 6 */
+	{  1,  4096, 9 },  /* 7 */
+	{  1, 16384, 9 },  /* 8 */
+	{  1,     0, 9 },  /* 9 */
+};
+
+/* Progress, cancellation, time budget and level of a diff, shared by its threads */
+struct diff_control
+{
+	struct bsdiff_ctx *ctx;
+	int64_t deadline;        /* bsdiff_clock_ms() when the time budget runs out, 0 = none */
+	volatile int canceled;   /* set once by any worker, see bsdiff_flag_set() */
+	const struct level_preset *preset;
+	int64_t fast_forward;    /* bsdiff_ctx::fast_forward, or the default of the level */
+};
+
+static void init_control(struct diff_control *control, struct bsdiff_ctx *ctx)
+{
+	int level = (ctx->level >= 1 && ctx->level <= 9) ? ctx->level : 9;
+
+	control->ctx = ctx;
+	control->deadline = (ctx->time_budget_ms > 0) ? bsdiff_clock_ms() + ctx->time_budget_ms : 0;
+	control->canceled = 0;
+	control->preset = &level_presets[level - 1];
+	control->fast_forward = (ctx->fast_forward != 0) ?
+		ctx->fast_forward : control->preset->fast_forward;
+}
+
+/* Passes the codec level of the preset and the compression threads to the
+   packer, if it takes them */
+static int configure_packer(struct diff_control *control, struct bsdiff_patch_packer *packer)
+{
+	struct bsdiff_ctx *ctx = control->ctx;
+	int ret;
+
+	if (ctx->level != 0 && packer->set_level != NULL) {
+		if ((ret = packer->set_level(packer->state, control->preset->codec_level)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	if (ctx->compress_threads > 1 && packer->set_threads != NULL) {
+		if ((ret = packer->set_threads(packer->state, ctx->compress_threads)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static int report_progress(struct diff_control *control, int phase, int64_t done, int64_t total)
+{
+	struct bsdiff_ctx *ctx = control->ctx;
+
+	if (bsdiff_flag_get(&control->canceled))
+		return BSDIFF_CANCELED;
+	if (ctx->progress != NULL && ctx->progress(ctx->opaque, phase, done, total) != 0) {
+		bsdiff_flag_set(&control->canceled);
+		return BSDIFF_CANCELED;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static int time_expired(const struct diff_control *control)
+{
+	return (control->deadline > 0) && (bsdiff_clock_ms() >= control->deadline);
+}
+
+struct scan_job
+{
+	const struct sa_index *idx;
+	const uint8_t *new;
+	int64_t start;
+	int64_t end;
+	int64_t oldstart;  /* position in old the scan starts from */
+	int64_t fast_forward;  /* see bsdiff_ctx::fast_forward, 0 = off */
+	struct diff_control *control;
+	int64_t progress_base;   /* bytes of new before start */
+	int64_t progress_total;  /* size of new */
+	int progress_scale;      /* partitions the job reports for, 0 if it doesn't report */
+	int (*emit)(void *opaque, const struct diff_entry *entry);
+	void *opaque;
+	int ret;
+};
+
+/* Reports the progress of a scan at `scan`, or just checks for cancellation */
+static int scan_checkpoint(struct scan_job *job, int64_t scan)
+{
+	int64_t done;
+
+	if (job->progress_scale == 0)
+		return bsdiff_flag_get(&job->control->canceled) ? BSDIFF_CANCELED : BSDIFF_SUCCESS;
+	done = job->progress_base + (scan - job->start) * job->progress_scale;
+	return report_progress(job->control, BSDIFF_PHASE_SCAN,
+		MIN(done, job->progress_total), job->progress_total);
+}
+
+/* Scans new[start, end) against the index, passing the entries to emit() */
+static int scan_range(struct scan_job *job)
+{
+	const uint8_t *old = job->idx->old, *new = job->new;
+	int64_t oldsize = job->idx->oldsize;
+	int64_t start = job->start, end = job->end;
+	int64_t scan, pos = 0, len;
+	int64_t lastscan, lastpos, lastoffset;
+	int64_t oldscore, scsc;
+	int64_t s, Sf, lenf, Sb, lenb;
+	int64_t overlap, Ss, lens;
+	int64_t i, k, n, blen, eq;
+	int64_t ffend = 0, ffoffset = 0;
+	int64_t hscan = 0, hpos = 0, hlen = 0, d;
+	int64_t next_check, interval, stride;
+	struct diff_entry entry;
+	int ret;
+
+	stride = job->control->preset->stride;
+
+	scan = start; len = 0;
+	lastscan = start; lastpos = job->oldstart; lastoffset = lastpos - lastscan;
+	interval = (job->control->ctx->progress_interval > 0) ?
+		job->control->ctx->progress_interval : PROGRESS_INTERVAL;
+	next_check = start;
+	if (job->control->ctx->progress == NULL && job->control->deadline == 0)
+		next_check = INT64_MAX;
+	while (scan < end) {
 		oldscore = 0;
 
-		for (scsc = scan+=len; scan < newsize; scan++) {
-			len = psearch(SA, old, oldsize, new+scan, newsize-scan,
-					0, oldsize, &pos);
+		for (scsc = scan+=len; scan < end; scan++) {
+			if (scan >= next_check) {
+				next_check = scan + interval;
+				if ((ret = scan_checkpoint(job, scan)) != BSDIFF_SUCCESS)
+					return ret;
+				if (stride < EXPIRED_STRIDE && time_expired(job->control))
+					stride = EXPIRED_STRIDE;
+			}
 
-			for (; scsc < scan + len; scsc++) {
-				if ((scsc + lastoffset < oldsize) &&
-					(old[scsc + lastoffset] == new[scsc]))
-				{
-					oldscore++;
+			/* A long run of equal bytes at the current alignment is taken
+			   as the match, without searching */
+			len = 0;
+			if (job->fast_forward > 0 && scan + lastoffset < oldsize) {
+				/* the run found at an earlier scan still holds up to ffend */
+				if (ffoffset != lastoffset || scan >= ffend) {
+					ffend = scan + bsdiff_matchlen(old + scan + lastoffset, new + scan,
+						MIN(end - scan, oldsize - scan - lastoffset));
+					ffoffset = lastoffset;
 				}
+				if (ffend - scan >= job->fast_forward) {
+					len = ffend - scan;
+					pos = scan + lastoffset;
+				}
+			}
+			if (len == 0) {
+				/* Inside the previous match, search from the rank of its
+				   successor in old */
+				d = scan - hscan;
+				if (job->idx->ISA != NULL && d > 0 && d < hlen) {
+					len = successor_search(job->idx, new+scan, end-scan,
+						sa_get(job->idx->ISA, job->idx->width, hpos + d), hlen - d, &pos);
+				} else {
+					len = index_search(job->idx, new+scan, end-scan, &pos);
+				}
+				hscan = scan; hpos = pos; hlen = len;
+			}
+
+			if (scsc < scan + len) {
+				n = MIN(scan + len, oldsize - lastoffset) - scsc;
+				if (n > 0)
+					oldscore += bsdiff_eqcount(old + scsc + lastoffset, new + scsc, n);
+				scsc = scan + len;
 			}
 
 			if (((len == oldscore) && (len != 0)) ||
@@ -219,34 +736,77 @@ int bsdiff(
 				break;
 			}
 
-			if ((scan + lastoffset < oldsize) &&
-				(old[scan + lastoffset] == new[scan]))
-			{
-				oldscore--;
+			if (stride == 1) {
+				if ((scan + lastoffset < oldsize) &&
+					(old[scan + lastoffset] == new[scan]))
+				{
+					oldscore--;
+				}
+			} else {
+				/* Only every stride-th position is searched (fast levels,
+				   or past the time budget), [scan, k) leaves the oldscore
+				   window [scan, scsc) */
+				k = MIN(scan + stride, end);
+				n = MIN(MIN(k, scsc), oldsize - lastoffset) - scan;
+				if (n > 0)
+					oldscore -= bsdiff_eqcount(old + scan + lastoffset, new + scan, n);
+				scsc = MAX(scsc, k);
+				scan = k - 1;
 			}
 		};
 
-		if ((len != oldscore) || (scan == newsize)) {
+		if ((len != oldscore) || (scan == end)) {
 			s = 0; Sf = 0; lenf = 0;
-			for (i = 0; (lastscan+i<scan) && (lastpos+i<oldsize);) {
-				if (old[lastpos+i] == new[lastscan+i])
-					s++;
-				i++;
-				if (s*2-i > Sf*2-lenf) { 
-					Sf = s; 
-					lenf = i;
+			n = MIN(scan - lastscan, oldsize - lastpos);
+			for (i = 0; i < n; ) {
+				/* Skip a block at once when it is all equal or when no
+				   prefix ending in it can beat the best score */
+				blen = MIN(n - i, SCORE_BLOCK_LEN);
+				eq = bsdiff_eqcount(old + lastpos + i, new + lastscan + i, blen);
+				if (eq == blen || s * 2 - i + eq <= Sf * 2 - lenf) {
+					s += eq;
+					i += blen;
+					if (s*2-i > Sf*2-lenf) {
+						Sf = s;
+						lenf = i;
+					}
+					continue;
+				}
+				for (k = i + blen; i < k; ) {
+					if (old[lastpos+i] == new[lastscan+i])
+						s++;
+					i++;
+					if (s*2-i > Sf*2-lenf) {
+						Sf = s;
+						lenf = i;
+					};
 				};
 			};
 
 			lenb = 0;
-			if (scan < newsize) {
+			if (scan < end) {
 				s = 0; Sb = 0;
-				for (i = 1; (scan>=lastscan+i) && (pos>=i); i++) {
-					if (old[pos-i] == new[scan-i])
-						s++;
-					if (s*2-i > Sb*2-lenb) {
-						Sb = s; 
-						lenb = i;
+				n = MIN(scan - lastscan, pos);
+				for (i = 1; i <= n; ) {
+					/* the same, backwards from scan and pos */
+					blen = MIN(n - i + 1, SCORE_BLOCK_LEN);
+					eq = bsdiff_eqcount(old + pos - i - blen + 1, new + scan - i - blen + 1, blen);
+					if (eq == blen || s * 2 - (i - 1) + eq <= Sb * 2 - lenb) {
+						s += eq;
+						i += blen;
+						if (s*2-(i-1) > Sb*2-lenb) {
+							Sb = s;
+							lenb = i - 1;
+						}
+						continue;
+					}
+					for (k = i + blen; i < k; i++) {
+						if (old[pos-i] == new[scan-i])
+							s++;
+						if (s*2-i > Sb*2-lenb) {
+							Sb = s;
+							lenb = i;
+						};
 					};
 				};
 			};
@@ -275,36 +835,13 @@ int bsdiff(
 				lenb -= lens;
 			};
 
-			/* Write entry header */
-			ret = packer->write_entry_header(
-				packer->state, 
-				lenf, 
-				(scan-lenb)-(lastscan+lenf), 
-				(pos-lenb)-(lastpos+lenf));
-			if (ret != BSDIFF_SUCCESS)
-				HANDLE_ERROR(BSDIFF_ERROR, "write entry header");
-
-			/* Write entry diff */
-			for (i = 0; i < lenf; ) {
-				dblen = lenf - i;
-				if (dblen > DB_BUF_LEN)
-					dblen = DB_BUF_LEN;
-				for (j = 0; j < dblen; j++) {
-					db[j] = new[lastscan+i+j]-old[lastpos+i+j];
-				}
-				ret = packer->write_entry_diff(packer->state, db, (size_t)dblen);
-				if (ret != BSDIFF_SUCCESS)
-					HANDLE_ERROR(BSDIFF_ERROR, "write entry diff");
-				i += dblen;
-			}
-
-			/* Write entry extra */
-			if ((scan-lenb)-(lastscan+lenf) > 0) {
-				ret = packer->write_entry_extra(
-					packer->state, &new[lastscan+lenf], (size_t)((scan-lenb)-(lastscan+lenf)));
-				if (ret != BSDIFF_SUCCESS)
-					HANDLE_ERROR(BSDIFF_ERROR, "write entry extra");
-			}
+			entry.newpos = lastscan;
+			entry.oldpos = lastpos;
+			entry.diff = lenf;
+			entry.extra = (scan-lenb)-(lastscan+lenf);
+			entry.seek = (pos-lenb)-(lastpos+lenf);
+			if ((ret = job->emit(job->opaque, &entry)) != BSDIFF_SUCCESS)
+				return ret;
 
 			lastscan = scan - lenb;
 			lastpos = pos - lenb;
@@ -312,17 +849,780 @@ int bsdiff(
 		};
 	};
 
+	return BSDIFF_SUCCESS;
+}
+
+/* Writes entries to the packer */
+struct entry_writer
+{
+	struct bsdiff_ctx *ctx;
+	struct bsdiff_patch_packer *packer;
+	const uint8_t *old;
+	const uint8_t *new;
+	uint8_t *db;
+};
+
+static int write_entry(void *opaque, const struct diff_entry *entry)
+{
+	struct entry_writer *w = (struct entry_writer*)opaque;
+	struct bsdiff_ctx *ctx = w->ctx;
+	struct bsdiff_patch_packer *packer = w->packer;
+	const uint8_t *old = w->old + entry->oldpos, *new = w->new + entry->newpos;
+	int64_t i, dblen;
+	int ret;
+
+	/* Write entry header */
+	ret = packer->write_entry_header(packer->state, entry->diff, entry->extra, entry->seek);
+	if (ret != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_ERROR, "write entry header");
+
+	/* Write entry diff, computed in chunks of the db buffer */
+	for (i = 0; i < entry->diff; ) {
+		dblen = entry->diff - i;
+		if (dblen > DB_BUF_LEN)
+			dblen = DB_BUF_LEN;
+		bsdiff_sub(w->db, new + i, old + i, dblen);
+		ret = packer->write_entry_diff(packer->state, w->db, (size_t)dblen);
+		if (ret != BSDIFF_SUCCESS)
+			HANDLE_ERROR(BSDIFF_ERROR, "write entry diff");
+		i += dblen;
+	}
+
+	/* Write entry extra */
+	if (entry->extra > 0) {
+		ret = packer->write_entry_extra(
+			packer->state, new + entry->diff, (size_t)entry->extra);
+		if (ret != BSDIFF_SUCCESS)
+			HANDLE_ERROR(BSDIFF_ERROR, "write entry extra");
+	}
+
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	return ret;
+}
+
+/* Collects the entries of a partition */
+struct entry_list
+{
+	struct diff_entry *entries;
+	int64_t count;
+	int64_t capacity;
+};
+
+static int append_entry(void *opaque, const struct diff_entry *entry)
+{
+	struct entry_list *list = (struct entry_list*)opaque;
+	struct diff_entry *entries;
+	int64_t capacity;
+
+	if (list->count == list->capacity) {
+		capacity = (list->capacity == 0) ? 256 : list->capacity * 2;
+		entries = realloc(list->entries, (size_t)capacity * sizeof(*entries));
+		if (entries == NULL)
+			return BSDIFF_OUT_OF_MEMORY;
+		list->entries = entries;
+		list->capacity = capacity;
+	}
+	list->entries[list->count++] = *entry;
+
+	return BSDIFF_SUCCESS;
+}
+
+static void scan_partition(void *arg, int i)
+{
+	struct scan_job *jobs = (struct scan_job*)arg;
+	jobs[i].ret = scan_range(&jobs[i]);
+}
+
+/*
+ * Scans the partitions of new concurrently, then writes their entries in
+ * order. Each partition starts as if the patch started there (at the same
+ * offset in old), and the seek of the last entry of a partition is fixed
+ * up to reach the first entry of the next one.
+ */
+static int scan_partitioned(struct bsdiff_ctx *ctx, struct diff_control *control,
+	const struct sa_index *idx, const uint8_t *new, int64_t newsize, int nparts,
+	struct entry_writer *writer)
+{
+	int ret;
+	int k;
+	int64_t i;
+	struct scan_job *jobs = NULL;
+	struct entry_list *lists = NULL;
+	struct diff_entry entry;
+
+	jobs = calloc((size_t)nparts, sizeof(*jobs));
+	lists = calloc((size_t)nparts, sizeof(*lists));
+	if (jobs == NULL || lists == NULL)
+		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for partitions");
+
+	for (k = 0; k < nparts; k++) {
+		jobs[k].idx = idx;
+		jobs[k].new = new;
+		jobs[k].start = newsize * k / nparts;
+		jobs[k].end = newsize * (k + 1) / nparts;
+		jobs[k].oldstart = jobs[k].start;
+		jobs[k].fast_forward = control->fast_forward;
+		/* the first partition reports for all of them */
+		jobs[k].control = control;
+		jobs[k].progress_total = newsize;
+		jobs[k].progress_scale = (k == 0) ? nparts : 0;
+		jobs[k].emit = append_entry;
+		jobs[k].opaque = &lists[k];
+	}
+	bsdiff_parallel_for(nparts, scan_partition, jobs);
+
+	for (k = 0; k < nparts; k++) {
+		if (jobs[k].ret != BSDIFF_SUCCESS)
+			HANDLE_ERROR(jobs[k].ret, "scan partition %d", k);
+	}
+
+	for (k = 0; k < nparts; k++) {
+		for (i = 0; i < lists[k].count; i++) {
+			entry = lists[k].entries[i];
+			if (i == lists[k].count - 1 && k + 1 < nparts && lists[k + 1].count > 0)
+				entry.seek = lists[k + 1].entries[0].oldpos - (entry.oldpos + entry.diff);
+			if ((ret = write_entry(writer, &entry)) != BSDIFF_SUCCESS)
+				goto cleanup;
+		}
+	}
+
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	if (lists != NULL) {
+		for (k = 0; k < nparts; k++)
+			free(lists[k].entries);
+		free(lists);
+	}
+	if (jobs != NULL) { free(jobs); }
+
+	return ret;
+}
+
+/* The index of the old file and the resources backing it */
+struct old_index
+{
+	struct sa_index idx;
+	uint8_t *old_owned;
+	uint8_t *SA_owned;
+	struct bsdiff_stream sa_mapping;
+};
+
+static void close_index(struct old_index *oi)
+{
+	if (oi->idx.bucket != NULL) { free(oi->idx.bucket); }
+	if (oi->idx.head != NULL) { free(oi->idx.head); }
+	if (oi->idx.chain != NULL) { free(oi->idx.chain); }
+	if (oi->idx.ISA != NULL) { free(oi->idx.ISA); }
+	if (oi->SA_owned != NULL) { free(oi->SA_owned); }
+	bsdiff_close_stream(&oi->sa_mapping);
+	if (oi->old_owned != NULL) { free(oi->old_owned); }
+	memset(oi, 0, sizeof(*oi));
+}
+
+/* Builds a suffix array of every k-th suffix of old into oi->SA_owned */
+static int construct_sparse_sa(struct old_index *oi, int k)
+{
+	struct sa_index *idx = &oi->idx;
+	int64_t m = (idx->oldsize + k - 1) / k;
+	int32_t *I = NULL, *V = NULL;
+	int64_t i;
+
+	if (m >= 0x7fffffff)
+		return BSDIFF_SIZE_TOO_LARGE;
+	if ((I = malloc((size_t)(m + 1) * sizeof(int32_t))) == NULL ||
+		(V = malloc((size_t)(m + 1) * sizeof(int32_t))) == NULL)
+	{
+		free(I);
+		return BSDIFF_OUT_OF_MEMORY;
+	}
+	bsdiff_sparse_sa(idx->old, idx->oldsize, k, I, V);
+	free(V);
+
+	/* Block indices to positions, the last block is the empty suffix */
+	if (idx->width == 4) {
+		for (i = 0; i <= m; i++)
+			I[i] = (int32_t)MIN((int64_t)I[i] * k, idx->oldsize);
+		oi->SA_owned = (uint8_t*)I;
+	} else {
+		if ((oi->SA_owned = malloc((size_t)((m + 1) * idx->width))) == NULL) {
+			free(I);
+			return BSDIFF_OUT_OF_MEMORY;
+		}
+		for (i = 0; i <= m; i++)
+			sa_set(oi->SA_owned, idx->width, i, MIN((int64_t)I[i] * k, idx->oldsize));
+		free(I);
+	}
+
+	idx->SA = oi->SA_owned;
+	idx->nsa = m;
+	idx->sample = k;
+	return BSDIFF_SUCCESS;
+}
+
+/* Loads the old file and builds its index, close_index() frees it even on failure */
+static int open_index(struct bsdiff_ctx *ctx, struct diff_control *control,
+	struct bsdiff_stream *oldfile, struct old_index *oi)
+{
+	int ret;
+	struct sa_index *idx = &oi->idx;
+	const uint8_t *old;
+	int64_t oldsize;
+	int64_t bufsize;
+	uint8_t *SA;
+	uint64_t key = 0;
+	int64_t i;
+
+	memset(oi, 0, sizeof(*oi));
+
+	/* Load the old file, borrowing its buffer if possible */
+	if ((ret = bsdiff_load_stream(oldfile, &old, &oldsize, &oi->old_owned)) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(ret, "load oldfile");
+
+	if ((ret = report_progress(control, BSDIFF_PHASE_INDEX, 0, oldsize)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	idx->old = old;
+	idx->oldsize = oldsize;
+	idx->width = sa_width(oldsize);
+	idx->nsa = oldsize;
+	idx->sample = 1;
+
+	/* Hash chains instead of a suffix array */
+	if (ctx->match_engine == BSDIFF_ENGINE_HASH) {
+		if (build_hash_chains(idx) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for hash chains");
+		goto cleanup;
+	}
+	if (ctx->match_engine != BSDIFF_ENGINE_SA)
+		HANDLE_ERROR(BSDIFF_INVALID_ARG, "unknown match_engine %d", ctx->match_engine);
+
+	/* A sparse suffix array, without cache or bucket table */
+	if (ctx->sa_sample_rate > 1) {
+		if ((ret = construct_sparse_sa(oi, ctx->sa_sample_rate)) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(ret, "construct sparse suffix array");
+		goto cleanup;
+	}
+
+	/* Map the suffix array from the cache */
+	if (ctx->sa_cache_dir != NULL) {
+		key = bsdiff_hash(old, oldsize);
+		bsdiff_sa_cache_load(ctx->sa_cache_dir, key, oldsize, idx->width, &oi->sa_mapping, &idx->SA);
+	}
+
+	/* Or construct it */
+	if (idx->SA == NULL) {
+		bufsize = (oldsize + 1) * MAX(idx->width, sa_native_width(oldsize));
+		if (bufsize < SIZE_MAX)
+			oi->SA_owned = malloc((size_t)bufsize);
+		if (oi->SA_owned == NULL)
+			HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for SA");
+
+		if (construct_sa(old, oldsize, oi->SA_owned, idx->width, ctx->num_threads) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(BSDIFF_ERROR, "construct suffix array");
+		/* Give back the memory saved by packing */
+		if (idx->width < sa_native_width(oldsize)) {
+			if ((SA = realloc(oi->SA_owned, (size_t)((oldsize + 1) * idx->width))) != NULL)
+				oi->SA_owned = SA;
+		}
+		idx->SA = oi->SA_owned;
+
+		/* A cache which can't be written only costs the next diff */
+		if (ctx->sa_cache_dir != NULL)
+			bsdiff_sa_cache_store(ctx->sa_cache_dir, key, oldsize, idx->width, oi->SA_owned);
+	}
+
+	/* Invert the suffix array for the successor search */
+	if (ctx->successor_search) {
+		if ((idx->ISA = malloc((size_t)((oldsize + 1) * idx->width))) == NULL)
+			HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for inverse SA");
+		for (i = 0; i <= oldsize; i++)
+			sa_set(idx->ISA, idx->width, sa_get(idx->SA, idx->width, i), i);
+	}
+
+	/* Build the bucket table */
+	if (ctx->bucket_bytes > 3)
+		HANDLE_ERROR(BSDIFF_INVALID_ARG, "bucket_bytes should be at most 3");
+	if (ctx->bucket_bytes >= 0) {
+		if (build_bucket(idx, (ctx->bucket_bytes == 0) ? 2 : ctx->bucket_bytes) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for bucket table");
+	}
+
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	if (ret == BSDIFF_SUCCESS)
+		ret = report_progress(control, BSDIFF_PHASE_INDEX, oldsize, oldsize);
+	return ret;
+}
+
+/* Generates the patch of a new file against an index of the old file */
+static int diff_new(struct bsdiff_ctx *ctx, struct diff_control *control,
+	const struct sa_index *idx, struct bsdiff_stream *newfile, struct bsdiff_patch_packer *packer)
+{
+	int ret;
+	const uint8_t *new;
+	uint8_t *new_owned = NULL;
+	int64_t newsize;
+	uint8_t *db = NULL;
+	struct entry_writer writer;
+	struct scan_job job;
+	int nparts;
+
+	/* Load the new file, borrowing its buffer if possible */
+	if ((ret = bsdiff_load_stream(newfile, &new, &newsize, &new_owned)) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(ret, "load newfile");
+
+	if ((db = malloc(DB_BUF_LEN)) == NULL)
+		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for db");
+
+	/* Begin write */
+	if (configure_packer(control, packer) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_INVALID_ARG, "configure packer");
+	if (packer->write_new_size(packer->state, newsize) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "write new size");
+
+	writer.ctx = ctx;
+	writer.packer = packer;
+	writer.old = idx->old;
+	writer.new = new;
+	writer.db = db;
+
+	/* Scan */
+	nparts = ctx->scan_partitions;
+	if (nparts > newsize / MIN_PARTITION_LEN)
+		nparts = (int)(newsize / MIN_PARTITION_LEN);
+	if (nparts > 1) {
+		if ((ret = scan_partitioned(ctx, control, idx, new, newsize, nparts, &writer)) != BSDIFF_SUCCESS)
+			goto cleanup;
+	} else {
+		job.idx = idx;
+		job.new = new;
+		job.start = 0;
+		job.end = newsize;
+		job.oldstart = 0;
+		job.fast_forward = control->fast_forward;
+		job.control = control;
+		job.progress_base = 0;
+		job.progress_total = newsize;
+		job.progress_scale = 1;
+		job.emit = write_entry;
+		job.opaque = &writer;
+		if ((ret = scan_range(&job)) != BSDIFF_SUCCESS)
+			goto cleanup;
+	}
+	if ((ret = report_progress(control, BSDIFF_PHASE_SCAN, newsize, newsize)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
 	/* Flush */
+	if ((ret = report_progress(control, BSDIFF_PHASE_FLUSH, 0, newsize)) != BSDIFF_SUCCESS)
+		goto cleanup;
+	if (packer->flush(packer->state) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_ERROR, "flush patch_packer");
+	if ((ret = report_progress(control, BSDIFF_PHASE_FLUSH, newsize, newsize)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	if (db != NULL) { free(db); }
+	if (new_owned != NULL) { free(new_owned); }
+
+	return ret;
+}
+
+/*
+ * Windowed diff, used when the whole index doesn't fit in the memory budget.
+ *
+ * new is cut into windows of `newlen` bytes. Each one is diffed against a
+ * window of `oldlen` bytes of old, around the position proportional to its
+ * own in new, with a suffix array of that window only. The scan of a window
+ * starts at that proportional position in old, and the last entry of the
+ * previous window seeks to it, so the entries just follow each other in an
+ * ordinary patch. Inputs without get_buffer are read window by window.
+ */
+struct window_writer
+{
+	struct entry_writer w;       /* old and new are the window buffers */
+	struct diff_entry pending;   /* the last entry is held back for its seek */
+	int has_pending;
+};
+
+static int window_emit(void *opaque, const struct diff_entry *entry)
+{
+	struct window_writer *ww = (struct window_writer*)opaque;
+	int ret = BSDIFF_SUCCESS;
+
+	if (ww->has_pending)
+		ret = write_entry(&ww->w, &ww->pending);
+	ww->pending = *entry;
+	ww->has_pending = 1;
+	return ret;
+}
+
+static int stream_size(struct bsdiff_stream *stream, const uint8_t **base, int64_t *size)
+{
+	const void *buffer;
+	size_t cb;
+
+	*base = NULL;
+	if (stream->get_buffer != NULL &&
+		stream->get_buffer(stream->state, &buffer, &cb) == BSDIFF_SUCCESS)
+	{
+		*base = (const uint8_t*)buffer;
+		*size = (int64_t)cb;
+		return BSDIFF_SUCCESS;
+	}
+	if ((stream->seek(stream->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
+		(stream->tell(stream->state, size) != BSDIFF_SUCCESS))
+	{
+		return BSDIFF_FILE_ERROR;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+/* Returns bytes [off, off+len) of a stream, borrowed from base or read into buf */
+static int read_window(struct bsdiff_stream *stream, const uint8_t *base,
+	int64_t off, int64_t len, uint8_t *buf, const uint8_t **window)
+{
+	size_t cb;
+
+	if (base != NULL) {
+		*window = base + off;
+		return BSDIFF_SUCCESS;
+	}
+	if ((stream->seek(stream->state, off, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS) ||
+		(stream->read(stream->state, buf, (size_t)len, &cb) != BSDIFF_SUCCESS) ||
+		(cb != (size_t)len))
+	{
+		return BSDIFF_FILE_ERROR;
+	}
+	*window = buf;
+	return BSDIFF_SUCCESS;
+}
+
+/* Where the scan of new[newpos...] starts in old */
+static int64_t proportional_pos(int64_t newpos, int64_t newsize, int64_t oldsize)
+{
+	return (newsize > 0) ? (int64_t)((double)newpos * (double)oldsize / (double)newsize) : 0;
+}
+
+static int diff_windowed(struct bsdiff_ctx *ctx, struct diff_control *control,
+	struct bsdiff_stream *oldfile, const uint8_t *oldbase, int64_t oldsize,
+	struct bsdiff_stream *newfile, const uint8_t *newbase, int64_t newsize,
+	int64_t oldlen, struct bsdiff_patch_packer *packer)
+{
+	int ret;
+	int64_t newlen = oldlen / 2;
+	int64_t ns, ne, os, oe, oldstart, nextstart;
+	uint8_t *SA = NULL, *oldbuf = NULL, *newbuf = NULL, *db = NULL;
+	struct sa_index idx;
+	struct window_writer ww;
+	struct scan_job job;
+
+	if (ctx->bucket_bytes > 3)
+		HANDLE_ERROR(BSDIFF_INVALID_ARG, "bucket_bytes should be at most 3");
+	if ((SA = malloc((size_t)(oldlen + 1) * 4)) == NULL ||
+		(oldbase == NULL && (oldbuf = malloc((size_t)oldlen)) == NULL) ||
+		(newbase == NULL && (newbuf = malloc((size_t)newlen)) == NULL) ||
+		(db = malloc(DB_BUF_LEN)) == NULL)
+	{
+		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for windows");
+	}
+
+	if (configure_packer(control, packer) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_INVALID_ARG, "configure packer");
+	if (packer->write_new_size(packer->state, newsize) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "write new size");
+
+	memset(&idx, 0, sizeof(idx));
+	memset(&ww, 0, sizeof(ww));
+	ww.w.ctx = ctx;
+	ww.w.packer = packer;
+	ww.w.db = db;
+
+	for (ns = 0, oldstart = 0; ns < newsize; ns = ne, oldstart = nextstart) {
+		ne = MIN(ns + newlen, newsize);
+		nextstart = proportional_pos(ne, newsize, oldsize);
+
+		/* The old window contains oldstart, with some room before it */
+		os = MAX(0, MIN(oldstart - oldlen / 4, oldsize - oldlen));
+		oe = MIN(oldsize, os + oldlen);
+
+		/* Index the old window */
+		if (read_window(oldfile, oldbase, os, oe - os, oldbuf, &idx.old) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(BSDIFF_FILE_ERROR, "read oldfile window");
+		idx.oldsize = oe - os;
+		idx.nsa = idx.oldsize;
+		idx.sample = 1;
+		idx.SA = SA;
+		idx.width = 4;
+		if (construct_sa(idx.old, idx.oldsize, SA, 4, ctx->num_threads) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(BSDIFF_ERROR, "construct suffix array");
+		if (ctx->bucket_bytes >= 0) {
+			if (build_bucket(&idx, (ctx->bucket_bytes == 0) ? 2 : ctx->bucket_bytes) != BSDIFF_SUCCESS)
+				HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for bucket table");
+		}
+
+		/* Scan the new window */
+		if (read_window(newfile, newbase, ns, ne - ns, newbuf, &job.new) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(BSDIFF_FILE_ERROR, "read newfile window");
+		ww.w.old = idx.old;
+		ww.w.new = job.new;
+		ww.has_pending = 0;
+		job.idx = &idx;
+		job.start = 0;
+		job.end = ne - ns;
+		job.oldstart = oldstart - os;
+		job.fast_forward = control->fast_forward;
+		job.control = control;
+		job.progress_base = ns;
+		job.progress_total = newsize;
+		job.progress_scale = 1;
+		job.emit = window_emit;
+		job.opaque = &ww;
+		if ((ret = scan_range(&job)) != BSDIFF_SUCCESS)
+			goto cleanup;
+
+		/* The last entry seeks to where the next window starts */
+		if (ww.has_pending) {
+			if (ne < newsize)
+				ww.pending.seek = nextstart - (os + ww.pending.oldpos + ww.pending.diff);
+			if ((ret = write_entry(&ww.w, &ww.pending)) != BSDIFF_SUCCESS)
+				goto cleanup;
+		}
+
+		free(idx.bucket);
+		idx.bucket = NULL;
+	}
+	if ((ret = report_progress(control, BSDIFF_PHASE_SCAN, newsize, newsize)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	if ((ret = report_progress(control, BSDIFF_PHASE_FLUSH, 0, newsize)) != BSDIFF_SUCCESS)
+		goto cleanup;
 	if (packer->flush(packer->state) != BSDIFF_SUCCESS)
 		HANDLE_ERROR(BSDIFF_ERROR, "flush patch_packer");
+	if ((ret = report_progress(control, BSDIFF_PHASE_FLUSH, newsize, newsize)) != BSDIFF_SUCCESS)
+		goto cleanup;
 
 	ret = BSDIFF_SUCCESS;
 
 cleanup:
+	if (idx.bucket != NULL) { free(idx.bucket); }
 	if (db != NULL) { free(db); }
+	if (newbuf != NULL) { free(newbuf); }
+	if (oldbuf != NULL) { free(oldbuf); }
 	if (SA != NULL) { free(SA); }
-	if (old != NULL) { free(old); }
-	if (new != NULL) { free(new); }
+
+	return ret;
+}
+
+/* Bytes of the bucket table of bucket_bytes with `width` bytes per entry */
+static int64_t bucket_len(int bucket_bytes, int width)
+{
+	int k = (bucket_bytes == 0) ? 2 : bucket_bytes;
+
+	if (bucket_bytes < 0 || bucket_bytes > 3)
+		return 0;
+	return (((int64_t)1 << (8 * k)) + 1) * width;
+}
+
+/* Peak bytes of the index of the whole old file that open_index() builds */
+static int64_t index_len(struct bsdiff_ctx *ctx, int64_t oldsize)
+{
+	int width = sa_width(oldsize);
+	int64_t m, len;
+	int bits;
+
+	if (ctx->match_engine == BSDIFF_ENGINE_HASH) {
+		for (bits = 16; bits < 26 && ((int64_t)1 << bits) < oldsize; bits++)
+			;
+		return (((int64_t)1 << bits) + oldsize + 1) * width;
+	}
+	/* the sparse suffix array is sorted in two int32 arrays, then widened */
+	if (ctx->sa_sample_rate > 1) {
+		m = (oldsize + ctx->sa_sample_rate - 1) / ctx->sa_sample_rate;
+		return (m + 1) * MAX(8, 4 + ((width == 4) ? 0 : width));
+	}
+	/* the suffix array is built at its native width before being packed */
+	len = (oldsize + 1) * MAX(width, sa_native_width(oldsize));
+	if (ctx->successor_search)
+		len += (oldsize + 1) * width;
+	return len + bucket_len(ctx->bucket_bytes, width);
+}
+
+/*
+ * Returns the length of the old windows which fit in ctx->memory_budget, or
+ * 0 if the index of the whole old file does. The budget covers the index,
+ * and the copies of the inputs when they can't be borrowed.
+ */
+static int64_t window_len(struct bsdiff_ctx *ctx, int64_t oldsize, int64_t newsize,
+	int old_borrowed, int new_borrowed)
+{
+	int64_t fixed, full, len;
+
+	full = DB_BUF_LEN + index_len(ctx, oldsize);
+	if (!old_borrowed)
+		full += oldsize;
+	if (!new_borrowed)
+		full += newsize;
+	if (ctx->memory_budget <= 0 || full <= ctx->memory_budget)
+		return 0;
+
+	/* a window has a 4-byte wide bucket table, and per 2 bytes of old
+	   window: its suffix array, the old and new buffers */
+	fixed = DB_BUF_LEN + bucket_len(ctx->bucket_bytes, 4);
+	if (ctx->memory_budget <= fixed)
+		return 1;  /* too small */
+	len = (ctx->memory_budget - fixed) * 2 / (8 + (old_borrowed ? 0 : 2) + (new_borrowed ? 0 : 1));
+	return MAX(1, MIN(len, 0x7ffffffe));
+}
+
+int bsdiff(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *oldfile, 
+	struct bsdiff_stream *newfile, 
+	struct bsdiff_patch_packer *packer)
+{
+	int ret;
+	struct old_index oi;
+	struct diff_control control;
+	const uint8_t *oldbase, *newbase;
+	int64_t oldsize, newsize, len;
+
+	assert(oldfile->get_mode(oldfile->state) == BSDIFF_MODE_READ);
+	assert(newfile->get_mode(newfile->state) == BSDIFF_MODE_READ);
+	assert(packer->get_mode(packer->state) == BSDIFF_MODE_WRITE);
+
+	init_control(&control, ctx);
+
+	/* Windowed diff when the index doesn't fit in the memory budget */
+	if (ctx->memory_budget > 0) {
+		if ((stream_size(oldfile, &oldbase, &oldsize) != BSDIFF_SUCCESS) ||
+			(stream_size(newfile, &newbase, &newsize) != BSDIFF_SUCCESS))
+		{
+			HANDLE_ERROR(BSDIFF_FILE_ERROR, "retrieve size of oldfile/newfile");
+		}
+		len = window_len(ctx, oldsize, newsize, oldbase != NULL, newbase != NULL);
+		if (len > 0 && len < MIN_WINDOW_LEN)
+			HANDLE_ERROR(BSDIFF_INVALID_ARG, "memory_budget is too small");
+		if (len > 0)
+			return diff_windowed(ctx, &control, oldfile, oldbase, oldsize, newfile, newbase, newsize, len, packer);
+	}
+
+	if ((ret = open_index(ctx, &control, oldfile, &oi)) == BSDIFF_SUCCESS)
+		ret = diff_new(ctx, &control, &oi.idx, newfile, packer);
+	close_index(&oi);
+
+cleanup:
+	return ret;
+}
+
+/* Targets of bsdiff_multi(), worker i diffs targets i, i+nworkers, ... */
+struct multi_job
+{
+	struct bsdiff_ctx *ctx;
+	struct diff_control *control;
+	const struct sa_index *idx;
+	struct bsdiff_target *targets;
+	int count;
+	int nworkers;
+};
+
+static void diff_targets(void *arg, int i)
+{
+	struct multi_job *job = (struct multi_job*)arg;
+	struct bsdiff_target *t;
+
+	for (; i < job->count; i += job->nworkers) {
+		t = &job->targets[i];
+		t->ret = diff_new(job->ctx, job->control, job->idx, t->newfile, t->packer);
+	}
+}
+
+int bsdiff_multi(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *oldfile,
+	struct bsdiff_target *targets,
+	int count)
+{
+	int ret;
+	int i;
+	struct old_index oi;
+	struct diff_control control;
+	struct multi_job job;
+
+	assert(oldfile->get_mode(oldfile->state) == BSDIFF_MODE_READ);
+	for (i = 0; i < count; i++) {
+		assert(targets[i].newfile->get_mode(targets[i].newfile->state) == BSDIFF_MODE_READ);
+		assert(targets[i].packer->get_mode(targets[i].packer->state) == BSDIFF_MODE_WRITE);
+		targets[i].ret = BSDIFF_ERROR;
+	}
+
+	init_control(&control, ctx);
+	if ((ret = open_index(ctx, &control, oldfile, &oi)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	job.ctx = ctx;
+	job.control = &control;
+	job.idx = &oi.idx;
+	job.targets = targets;
+	job.count = count;
+	job.nworkers = (ctx->num_threads > 1) ? ctx->num_threads : 1;
+	if (job.nworkers > count)
+		job.nworkers = count;
+	if (job.nworkers > 0)
+		bsdiff_parallel_for(job.nworkers, diff_targets, &job);
+
+	for (i = 0; i < count; i++) {
+		if (targets[i].ret != BSDIFF_SUCCESS) {
+			ret = targets[i].ret;
+			break;
+		}
+	}
+
+cleanup:
+	close_index(&oi);
+
+	return ret;
+}
+
+int bsdiff_buffers(
+	struct bsdiff_ctx *ctx,
+	const void *old,
+	size_t oldsize,
+	const void *new,
+	size_t newsize,
+	void **patch,
+	size_t *patchsize)
+{
+	int ret;
+	struct bsdiff_stream oldfile = { 0 }, newfile = { 0 }, patchfile = { 0 };
+	struct bsdiff_patch_packer packer = { 0 };
+
+	*patch = NULL;
+	*patchsize = 0;
+
+	if ((bsdiff_open_memory_stream(BSDIFF_MODE_READ, old, oldsize, &oldfile) != BSDIFF_SUCCESS) ||
+		(bsdiff_open_memory_stream(BSDIFF_MODE_READ, new, newsize, &newfile) != BSDIFF_SUCCESS) ||
+		(bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, NULL, 0, &patchfile) != BSDIFF_SUCCESS) ||
+		(bsdiff_open_bz2_patch_packer(BSDIFF_MODE_WRITE, &patchfile, &packer) != BSDIFF_SUCCESS))
+	{
+		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "open memory streams");
+	}
+
+	if ((ret = bsdiff(ctx, &oldfile, &newfile, &packer)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	bsdiff_memory_stream_detach(&patchfile, patch, patchsize);
+
+cleanup:
+	bsdiff_close_patch_packer(&packer);
+	bsdiff_close_stream(&patchfile);
+	bsdiff_close_stream(&newfile);
+	bsdiff_close_stream(&oldfile);
 
 	return ret;
 }
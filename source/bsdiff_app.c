@@ -26,6 +26,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "bsdiff.h"
 
 static void log_error(void *opaque, const char *errmsg)
@@ -34,204 +36,164 @@ static void log_error(void *opaque, const char *errmsg)
 	fprintf(stderr, "%s", errmsg);
 }
 
-int main(int argc, char * argv[])
+/* Inputs are mapped into memory when possible, falling back to stdio */
+static int open_input(const char *filename, struct bsdiff_stream *stream)
 {
-	testDirectBuffer();
-	//testMemory(argc, argv);
-	//testFile(argc, argv);
-	return 0;
+	if (bsdiff_open_mmap_stream(filename, stream) == BSDIFF_SUCCESS)
+		return BSDIFF_SUCCESS;
+	return bsdiff_open_file_stream(BSDIFF_MODE_READ, filename, stream);
 }
 
-int testDirectBuffer() {
-	int ret = 1;
-	struct bsdiff_stream oldfile = { 0 }, newfile = { 0 }, patchfile = { 0 }, newfile2 = { 0 };
-	struct bsdiff_ctx ctx = { 0 };
-	struct bsdiff_patch_packer packer = { 0 }, packer2 = { 0 };
-	char* source = "THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR";
-	char* dest = "BY THE AUTHORTHIS IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR THIS SOFTWARE IS PROVIDED BY THE AUTHOR ''AS IS'' AND ANY EXPRESS OR";
-
-	if ((ret = bsdiff_open_memory_stream(BSDIFF_MODE_READ, source, strlen(source), &oldfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open oldfile: %s\n", source);
-		goto cleanup;
-	}
-	if ((ret = bsdiff_open_memory_stream(BSDIFF_MODE_READ, dest, strlen(dest), &newfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open newfile: %s\n", dest);
-		goto cleanup;
-	}
-	char* patch = NULL;
-	if ((ret = bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, patch, 0, &patchfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open patchfile\n");
-		goto cleanup;
-	}
-	if ((ret = bsdiff_open_bz2_patch_packer(BSDIFF_MODE_WRITE, &patchfile, &packer)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't create BZ2 patch packer\n");
-		goto cleanup;
-	}
-
-	ctx.log_error = log_error;
-	if ((ret = bsdiff(&ctx, &oldfile, &newfile, &packer)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "bsdiff failed: %d\n", ret);
-		goto cleanup;
-	}
-	fprintf(stderr, "patch file: %s \n", patch);
-	/*struct bz2_patch_packer* bz2_pactch = (struct bz2_patch_packer*)packer.state;
-	struct bsdiff_stream* bsStream = (struct bsdiff_stream*) (bz2_pactch->stream);
-	char **temp = NULL;
-	size_t sSize = 0;
-	bsStream->get_buffer(bsStream->state, temp, &sSize);*/
-	//fprintf(stderr, "patch file: %s",*temp);
-
-
-	patchfile.set_mode(&patchfile, BSDIFF_MODE_READ);
-	patchfile.seek(patchfile.state, 0, BSDIFF_SEEK_SET);
-	packer.set_mode(&packer, BSDIFF_MODE_READ);
-	char* buffer = NULL ;
-	size_t psize =0;
-	//todo? packer->cpf_dec.state  these value is free，error happened
-	patchfile.get_buffer(patchfile.state, &buffer, &psize);
-	fprintf(stderr, "patch packer %s, size = %d\n",buffer,psize);
-	if ((ret = bsdiff_open_memory_stream(BSDIFF_MODE_READ, buffer, 0, &patchfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open patchfile\n");
-		goto cleanup;
-	}
-	if ((ret = bsdiff_open_bz2_patch_packer(BSDIFF_MODE_READ, &patchfile, &packer2)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't create BZ2 patch packer\n");
-		goto cleanup;
-	}
-
-	char* destGen = NULL;
-	if ((ret = bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, destGen, 0, &newfile2)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open newfile: %s\n", dest);
-		goto cleanup;
-	}
-	if ((ret = bspatch(&ctx, &oldfile, &newfile2, &packer)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "bspatch failed: %d\n", ret);
-		goto cleanup;
-	}
-	patchfile.get_buffer(newfile2.state, &buffer, &psize);
-	fprintf(stderr, "newfile2 packer %s, size = %d\n", buffer, psize);
-	//printf("new file: %s", (char*)temp->buffer);
-
-
-
-cleanup:
-	bsdiff_close_patch_packer(&packer);
-	bsdiff_close_stream(&patchfile);
-	bsdiff_close_stream(&newfile);
-	bsdiff_close_stream(&oldfile);
-	bsdiff_close_stream(&newfile);
-	bsdiff_close_stream(&newfile2);
+static int print_progress(void *opaque, int phase, int64_t done, int64_t total)
+{
+	static const char *names[] = { "index", "scan", "flush" };
+	(void)opaque;
+	fprintf(stderr, "\r%-5s %3d%%", names[phase], (total > 0) ? (int)(done * 100 / total) : 100);
+	if (done == total)
+		fprintf(stderr, "\n");
+	return 0;
+}
 
-	//free(patch);
-	return ret;
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-j threads] [-p partitions] [-C cachedir] [-m budget_MiB] [-s sample_rate] [-e sa|hash] [-f fast_forward] [-r] [-t budget_ms] [-l level] [-z compress_threads] [-c bz2|zstd|store] [-F frame_KiB] [-v] oldfile newfile patchfile [newfile patchfile ...]\n", prog);
 }
 
-int testMemory(int argc, char* argv[]) {
+int main(int argc, char *argv[])
+{
 	int ret = 1;
-	struct bsdiff_stream oldfile = { 0 }, newfile = { 0 }, patchfile = { 0 };
+	int i, k, count;
+	const char *oldname, *newname, *patchname;
+	struct bsdiff_stream oldfile = { 0 };
+	struct bsdiff_stream *newfiles = NULL, *patchfiles = NULL;
+	struct bsdiff_patch_packer *packers = NULL;
+	struct bsdiff_target *targets = NULL;
 	struct bsdiff_ctx ctx = { 0 };
-	struct bsdiff_patch_packer packer = { 0 };
-	argv[1] = "c:\\Users\\liudongdong\\OneDrive - tju.edu.cn\\����\\android_sourcecode\\c_code\\bsdiff\\testdata\\simple\\v1.c";
-	argv[2] = "c:\\Users\\liudongdong\\OneDrive - tju.edu.cn\\����\\android_sourcecode\\c_code\\bsdiff\\testdata\\simple\\v2.c";
-	argv[3] = "c:\\Users\\liudongdong\\OneDrive - tju.edu.cn\\����\\android_sourcecode\\c_code\\bsdiff\\testdata\\simple\\patch";
-	void* buf = NULL;
-	argc = 4;
-	if (argc != 4) {
-		printf("caolskajdlfkajskld");
-		fprintf(stderr, "usage: %s oldfile newfile patchfile\n", argv[0]);
+	const char *codec = "bz2";
+	int64_t frame_size = -1;  /* not framed */
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			ctx.num_threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			ctx.scan_partitions = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+			ctx.sa_cache_dir = argv[++i];
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			ctx.memory_budget = (int64_t)atoi(argv[++i]) << 20;
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			ctx.sa_sample_rate = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "sa") == 0) {
+				ctx.match_engine = BSDIFF_ENGINE_SA;
+			} else if (strcmp(argv[i], "hash") == 0) {
+				ctx.match_engine = BSDIFF_ENGINE_HASH;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			ctx.time_budget_ms = atoll(argv[++i]);
+		} else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			ctx.level = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc) {
+			ctx.compress_threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			codec = argv[++i];
+			if (strcmp(codec, "bz2") != 0 && strcmp(codec, "zstd") != 0 && strcmp(codec, "store") != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc) {
+			frame_size = (int64_t)atoi(argv[++i]) << 10;
+			if (frame_size < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-v") == 0) {
+			ctx.progress = print_progress;
+		} else if (strcmp(argv[i], "-r") == 0) {
+			ctx.successor_search = 1;
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			ctx.fast_forward = atoll(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - i < 3 || (argc - i) % 2 != 1) {
+		usage(argv[0]);
 		return 1;
 	}
-
-	if ((ret = bsdiff_open_memory_stream(BSDIFF_MODE_READ, argv[1],strlen(argv[1]), &oldfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open oldfile: %s\n", argv[1]);
-		goto cleanup;
-	}
-	if ((ret = bsdiff_open_memory_stream(BSDIFF_MODE_READ, argv[2], strlen(argv[2]), &newfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open newfile: %s\n", argv[2]);
-		goto cleanup;
-	}
-
-	if ((ret = bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, buf, 0, &patchfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open patchfile: %s\n", argv[2]);
-		goto cleanup;
-	}
-
-	/*if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_WRITE, argv[3], &patchfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open patchfile: %s\n", argv[3]);
-		goto cleanup;
-	}*/
-	if ((ret = bsdiff_open_bz2_patch_packer(BSDIFF_MODE_WRITE, &patchfile, &packer)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't create BZ2 patch packer\n");
-		goto cleanup;
+	oldname = argv[i];
+	count = (argc - i - 1) / 2;
+
+	newfiles = calloc(count, sizeof(*newfiles));
+	patchfiles = calloc(count, sizeof(*patchfiles));
+	packers = calloc(count, sizeof(*packers));
+	targets = calloc(count, sizeof(*targets));
+	if (newfiles == NULL || patchfiles == NULL || packers == NULL || targets == NULL) {
+		fprintf(stderr, "out of memory\n");
+		goto cleanup;
+	}
+
+	if ((ret = open_input(oldname, &oldfile)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "can't open oldfile: %s\n", oldname);
+		goto cleanup;
+	}
+	for (k = 0; k < count; k++) {
+		newname = argv[i + 1 + 2 * k];
+		patchname = argv[i + 2 + 2 * k];
+		if ((ret = open_input(newname, &newfiles[k])) != BSDIFF_SUCCESS) {
+			fprintf(stderr, "can't open newfile: %s\n", newname);
+			goto cleanup;
+		}
+		if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_WRITE, patchname, &patchfiles[k])) != BSDIFF_SUCCESS) {
+			fprintf(stderr, "can't open patchfile: %s\n", patchname);
+			goto cleanup;
+		}
+		if (frame_size >= 0)
+			ret = bsdiff_open_frame_patch_packer(BSDIFF_MODE_WRITE, &patchfiles[k],
+				(strcmp(codec, "zstd") == 0) ? BSDIFF_CODEC_ZSTD :
+				(strcmp(codec, "store") == 0) ? BSDIFF_CODEC_STORE : BSDIFF_CODEC_BZ2,
+				frame_size, &packers[k]);
+		else if (strcmp(codec, "zstd") == 0)
+			ret = bsdiff_open_zstd_patch_packer(BSDIFF_MODE_WRITE, &patchfiles[k], NULL, &packers[k]);
+		else if (strcmp(codec, "store") == 0)
+			ret = bsdiff_open_store_patch_packer(BSDIFF_MODE_WRITE, &patchfiles[k], &packers[k]);
+		else
+			ret = bsdiff_open_bz2_patch_packer(BSDIFF_MODE_WRITE, &patchfiles[k], &packers[k]);
+		if (ret != BSDIFF_SUCCESS) {
+			fprintf(stderr, "can't create %s patch packer\n", codec);
+			goto cleanup;
+		}
+		targets[k].newfile = &newfiles[k];
+		targets[k].packer = &packers[k];
 	}
 
 	ctx.log_error = log_error;
 
-	if ((ret = bsdiff(&ctx, &oldfile, &newfile, &packer)) != BSDIFF_SUCCESS) {
+	if (count == 1)
+		ret = bsdiff(&ctx, &oldfile, &newfiles[0], &packers[0]);
+	else
+		ret = bsdiff_multi(&ctx, &oldfile, targets, count);
+	if (ret != BSDIFF_SUCCESS) {
 		fprintf(stderr, "bsdiff failed: %d\n", ret);
 		goto cleanup;
 	}
-	char* buffer = NULL;
-	size_t psize = 0;
-	patchfile.get_buffer(newfile.state, &buffer, &psize);
-	fprintf(stderr, "newfile packer %s, size = %d\n", buffer, psize);
-
-	patchfile.get_buffer(patchfile.state, &buffer, &psize);
-	fprintf(stderr, "patch packer %s, size = %d\n", buffer, psize);
 
 cleanup:
-	bsdiff_close_patch_packer(&packer);
-	bsdiff_close_stream(&patchfile);
-	bsdiff_close_stream(&newfile);
-	bsdiff_close_stream(&oldfile);
-	//free(patch);
-	return ret;
-}
-
-int testFile(int argc, char* argv[]) {
-	int ret = 1;
-	struct bsdiff_stream oldfile = { 0 }, newfile = { 0 }, patchfile = { 0 };
-	struct bsdiff_ctx ctx = { 0 };
-	struct bsdiff_patch_packer packer = { 0 };
-	argv[1] = "D:\\temp\\v1.c";
-	argv[2] = "D:\\temp\\v2.c";
-	argv[3] = "D:\\temp\\patch";
-	argc = 4;
-	if (argc != 4) {
-		printf("caolskajdlfkajskld");
-		fprintf(stderr, "usage: %s oldfile newfile patchfile\n", argv[0]);
-		return 1;
-	}
-
-	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_READ, argv[1], &oldfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open oldfile: %s\n", argv[1]);
-		goto cleanup;
+	for (k = 0; newfiles != NULL && patchfiles != NULL && packers != NULL && k < count; k++) {
+		bsdiff_close_patch_packer(&packers[k]);
+		bsdiff_close_stream(&patchfiles[k]);
+		bsdiff_close_stream(&newfiles[k]);
 	}
-	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_READ, argv[2], &newfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open newfile: %s\n", argv[2]);
-		goto cleanup;
-	}
-	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_WRITE, argv[3], &patchfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open patchfile: %s\n", argv[3]);
-		goto cleanup;
-	}
-	if ((ret = bsdiff_open_bz2_patch_packer(BSDIFF_MODE_WRITE, &patchfile, &packer)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't create BZ2 patch packer\n");
-		goto cleanup;
-	}
-	
-	ctx.log_error = log_error;
-
-	if ((ret = bsdiff(&ctx, &oldfile, &newfile, &packer)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "bsdiff failed: %d\n", ret);
-		goto cleanup;
-	}
-
-cleanup:
-	bsdiff_close_patch_packer(&packer);
-	bsdiff_close_stream(&patchfile);
-	bsdiff_close_stream(&newfile);
 	bsdiff_close_stream(&oldfile);
+	free(targets);
+	free(packers);
+	free(patchfiles);
+	free(newfiles);
 
 	return ret;
-}
\ No newline at end of file
+}
@@ -18,6 +18,54 @@ int bsdiff_open_substream(
 	int64_t read_end,
 	struct bsdiff_stream *substream);
 
+/* Returns the whole content of a read mode stream. The buffer of the stream
+   is borrowed if it implements get_buffer, otherwise the content is read
+   into a malloc'ed buffer returned in *owned, which the caller frees. */
+int bsdiff_load_stream(
+	struct bsdiff_stream *stream,
+	const uint8_t **pbuffer,
+	int64_t *psize,
+	uint8_t **owned);
+
+/* Opens an anonymous temporary file as a write mode stream, which its
+   set_mode() switches to reading (after a seek) and back. */
+int bsdiff_open_tmpfile_stream(
+	struct bsdiff_stream *stream);
+
+/* Takes the buffer of a write mode memory stream, which is left empty.
+   The buffer is released with bsdiff_free(). */
+void bsdiff_memory_stream_detach(
+	struct bsdiff_stream *stream,
+	void **pbuffer,
+	size_t *psize);
+
+/* Monotonic clock in milliseconds. */
+int64_t bsdiff_clock_ms(void);
+
+/* Suffix array cache, see sa_cache.c. bsdiff_sa_cache_load() maps a valid
+   cache into `mapping`, which must be closed once SA isn't used anymore. */
+uint64_t bsdiff_hash(const uint8_t *buf, int64_t size);
+
+int bsdiff_sa_cache_load(
+	const char *dir,
+	uint64_t key,
+	int64_t oldsize,
+	int width,
+	struct bsdiff_stream *mapping,
+	const uint8_t **SA);
+
+int bsdiff_sa_cache_store(
+	const char *dir,
+	uint64_t key,
+	int64_t oldsize,
+	int width,
+	const uint8_t *SA);
+
+/* Sorts the suffixes of old starting at multiples of k, see sparse_sa.c.
+   I and V hold m+1 entries, m = ceil(oldsize/k). On return I[r] is the
+   block index of the suffix of rank r, I[0] = m is the empty suffix. */
+void bsdiff_sparse_sa(const uint8_t *old, int64_t oldsize, int k, int32_t *I, int32_t *V);
+
 
 /* bsdiff_compressor */
 struct bsdiff_compressor
@@ -32,6 +80,12 @@ struct bsdiff_compressor
 void bsdiff_close_compressor(
 	struct bsdiff_compressor *enc);
 
+/* Wraps `inner`, which it takes over, into a compressor that runs it on a
+   worker thread, see compressor_async.c. */
+int bsdiff_create_async_compressor(
+	struct bsdiff_compressor *enc,
+	struct bsdiff_compressor *inner);
+
 
 /* bsdiff_decompressor */
 struct bsdiff_decompressor
@@ -45,4 +99,65 @@ struct bsdiff_decompressor
 void bsdiff_close_decompressor(
 	struct bsdiff_decompressor *dec);
 
+/* A codec of the blocks of a patch, see patch_packer.c */
+struct bsdiff_codec
+{
+	const char *magic;
+	/* native levels of the control, diff and extra blocks for the levels
+	   1..9 of set_level, the default is level 9 */
+	int presets[9][3];
+	int (*create_compressor)(struct bsdiff_compressor *enc, int level, int threads);
+	int (*create_decompressor)(struct bsdiff_decompressor *dec);
+	/* the blocks are stored as is: written without a worker thread, and
+	   used in place when the patch is in memory */
+	int stored;
+};
+
+/* The 8-byte sign-magnitude little-endian numbers of the patch formats. */
+int64_t bsdiff_offtin(const uint8_t *buf);
+void bsdiff_offtout(int64_t x, uint8_t *buf);
+
+/* The codec BSDIFF_CODEC_*, NULL if it isn't built. */
+const struct bsdiff_codec *bsdiff_get_codec(int codec);
+
+/* The codec of the 8-byte magic of a patch, NULL if none. */
+const struct bsdiff_codec *bsdiff_find_codec(const void *magic);
+
+/* Runs fn(arg, i) for i in [0, n) concurrently, fn(arg, 0) on the calling thread. */
+void bsdiff_parallel_for(int n, void (*fn)(void *arg, int i), void *arg);
+
+/* A flag set once and read by several threads, e.g. the cancellation of a diff. */
+int bsdiff_flag_get(volatile int *flag);
+void bsdiff_flag_set(volatile int *flag);
+
+/* SIMD kernels, the widest supported by the CPU is selected at runtime */
+typedef int64_t (*bsdiff_matchlen_fn)(const uint8_t *a, const uint8_t *b, int64_t n);
+typedef void (*bsdiff_sub_fn)(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n);
+typedef int64_t (*bsdiff_eqcount_fn)(const uint8_t *a, const uint8_t *b, int64_t n);
+typedef void (*bsdiff_add_fn)(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n);
+
+struct bsdiff_simd_impl
+{
+	const char *name;
+	bsdiff_matchlen_fn matchlen;
+	bsdiff_sub_fn sub;
+	bsdiff_eqcount_fn eqcount;
+	bsdiff_add_fn add;
+};
+
+/* Lists the implementations supported by the CPU, from scalar to widest. */
+int bsdiff_simd_impls(const struct bsdiff_simd_impl **impls, int max);
+
+/* Length of the common prefix of a and b, at most n bytes. */
+int64_t bsdiff_matchlen(const uint8_t *a, const uint8_t *b, int64_t n);
+
+/* dst[i] = a[i] - b[i] for i in [0, n), dst may be a or b but not overlap them otherwise. */
+void bsdiff_sub(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n);
+
+/* Number of positions in [0, n) where a and b hold the same byte. */
+int64_t bsdiff_eqcount(const uint8_t *a, const uint8_t *b, int64_t n);
+
+/* dst[i] = a[i] + b[i] for i in [0, n), dst may be a or b but not overlap them otherwise. */
+void bsdiff_add(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n);
+
 #endif /* !__BSDIFF_PRIVATE_H__ */
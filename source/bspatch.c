@@ -35,47 +35,26 @@
 #include "bsdiff.h"
 #include "bsdiff_private.h"
 
-int bspatch(
+/* Rebuilds new[0, newsize) from the entries of packer, starting at oldpos
+   in the old file. */
+static int apply_entries(
 	struct bsdiff_ctx *ctx,
-	struct bsdiff_stream *oldfile, 
-	struct bsdiff_stream *newfile,
-	struct bsdiff_patch_packer *packer)
+	struct bsdiff_patch_packer *packer,
+	const uint8_t *old,
+	int64_t oldsize,
+	uint8_t *new,
+	int64_t newsize,
+	int64_t oldpos)
 {
 	int ret;
 	size_t cb;
-	int64_t oldsize, newsize;
-	uint8_t *old = NULL, *new = NULL;
-	int64_t oldpos, newpos;
+	int64_t newpos;
 	int64_t ctrl[3];
-	int64_t i;
-
-	assert(oldfile->get_mode(oldfile->state) == BSDIFF_MODE_READ);
-	assert(newfile->get_mode(newfile->state) == BSDIFF_MODE_WRITE);
-	assert(packer->get_mode(packer->state) == BSDIFF_MODE_READ);
+	int64_t lo, hi;
+	const void *mapped;
+	const uint8_t *diff;
 
-	//check and read old file to old buffer
-	if ((oldfile->seek(oldfile->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
-		(oldfile->tell(oldfile->state, &oldsize) != BSDIFF_SUCCESS) ||
-		(oldfile->seek(oldfile->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS))
-	{
-		HANDLE_ERROR(BSDIFF_FILE_ERROR, "retrieve size of oldfile");
-	}
-	if (oldsize >= SIZE_MAX)
-		HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "oldfile is too large");
-	if ((old = malloc((size_t)(oldsize + 1))) == NULL)
-		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for old");
-	if (oldfile->read(oldfile->state, old, (size_t)oldsize, &cb) != BSDIFF_SUCCESS)
-		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read oldfile");
-	
-	// check and read newfile data to new buffer
-	if (packer->read_new_size(packer->state, &newsize) != BSDIFF_SUCCESS)
-		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read new size from patch_packer");
-	if (newsize >= SIZE_MAX)
-		HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "newfile is too large");
-	if ((new = malloc((size_t)(newsize + 1))) == NULL)
-		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for new");
-
-	oldpos = 0; newpos = 0;
+	newpos = 0;
 	while (newpos < newsize) {
 		/* Read control data */
 		ret = packer->read_entry_header(packer->state, &ctrl[0], &ctrl[1], &ctrl[2]);
@@ -91,16 +70,32 @@ int bspatch(
 		/* Read diff string */
 		if (ctrl[0] >= SIZE_MAX)
 			HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "read diff string");
-		ret = packer->read_entry_diff(packer->state, new + newpos, (size_t)ctrl[0], &cb);
-		if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != (size_t)ctrl[0]))
-			HANDLE_ERROR(BSDIFF_FILE_ERROR, "read diff string");
-
-		/* Add old data to diff string */
-		for (i = 0; i < ctrl[0]; i++) {
-			if ((oldpos + i >= 0) && (oldpos + i < oldsize))
-				new[newpos + i] += old[oldpos + i];
+		if (packer->map_entry_diff != NULL &&
+			packer->map_entry_diff(packer->state, (size_t)ctrl[0], &mapped) == BSDIFF_SUCCESS)
+		{
+			/* the diff string is used in place */
+			diff = (const uint8_t*)mapped;
+		} else {
+			ret = packer->read_entry_diff(packer->state, new + newpos, (size_t)ctrl[0], &cb);
+			if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != (size_t)ctrl[0]))
+				HANDLE_ERROR(BSDIFF_FILE_ERROR, "read diff string");
+			diff = new + newpos;
 		}
 
+		/* Add old data to diff string, [lo, hi) is the part within old */
+		lo = (oldpos < 0) ? -oldpos : 0;
+		hi = (oldpos + ctrl[0] > oldsize) ? oldsize - oldpos : ctrl[0];
+		if (lo > ctrl[0])
+			lo = ctrl[0];
+		if (hi < lo)
+			hi = lo;
+		if (diff != new + newpos) {
+			memcpy(new + newpos, diff, (size_t)lo);
+			memcpy(new + newpos + hi, diff + hi, (size_t)(ctrl[0] - hi));
+		}
+		if (hi > lo)
+			bsdiff_add(new + newpos + lo, diff + lo, old + oldpos + lo, hi - lo);
+
 		/* Adjust pointers */
 		newpos += ctrl[0];
 		oldpos += ctrl[0];
@@ -112,15 +107,132 @@ int bspatch(
 		/* Read extra string */
 		if (ctrl[1] >= SIZE_MAX)
 			HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "read extra string");
-		ret = packer->read_entry_extra(packer->state, new + newpos, (size_t)ctrl[1], &cb);
-		if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != (size_t)ctrl[1]))
-			HANDLE_ERROR(BSDIFF_FILE_ERROR, "read extra string");
+		if (packer->map_entry_extra != NULL &&
+			packer->map_entry_extra(packer->state, (size_t)ctrl[1], &mapped) == BSDIFF_SUCCESS)
+		{
+			memcpy(new + newpos, mapped, (size_t)ctrl[1]);
+		} else {
+			ret = packer->read_entry_extra(packer->state, new + newpos, (size_t)ctrl[1], &cb);
+			if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != (size_t)ctrl[1]))
+				HANDLE_ERROR(BSDIFF_FILE_ERROR, "read extra string");
+		}
 
 		/* Adjust pointers */
 		newpos += ctrl[1];
 		oldpos += ctrl[2];
 	};
 
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	return ret;
+}
+
+/* Rebuilds frame `index` of a framed patch into new, which receives the
+   range [new_start, new_end) of the frame at new + (new_start - base). */
+static int apply_frame(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_patch_packer *packer,
+	int64_t index,
+	const uint8_t *old,
+	int64_t oldsize,
+	uint8_t *new,
+	int64_t base)
+{
+	int ret;
+	struct bsdiff_patch_packer frame = { 0 };
+	int64_t new_start, new_end, old_start, size;
+
+	ret = packer->open_frame(packer->state, index, &frame, &new_start, &new_end, &old_start);
+	if (ret != BSDIFF_SUCCESS)
+		return ret;
+	if (frame.read_new_size(frame.state, &size) != BSDIFF_SUCCESS || size != new_end - new_start)
+		ret = BSDIFF_CORRUPT_PATCH;
+	else
+		ret = apply_entries(ctx, &frame, old, oldsize, new + (new_start - base), size, old_start);
+	bsdiff_close_patch_packer(&frame);
+
+	return ret;
+}
+
+struct frame_workers
+{
+	struct bsdiff_ctx *ctx;
+	struct bsdiff_patch_packer *packer;
+	const uint8_t *old;
+	int64_t oldsize;
+	uint8_t *new;
+	int64_t count;
+	int workers;
+	int *ret;
+};
+
+/* Worker i applies the frames i, i + workers, ... */
+static void frame_worker(void *arg, int i)
+{
+	struct frame_workers *w = (struct frame_workers*)arg;
+	int64_t k;
+
+	w->ret[i] = BSDIFF_SUCCESS;
+	for (k = i; k < w->count && w->ret[i] == BSDIFF_SUCCESS; k += w->workers)
+		w->ret[i] = apply_frame(w->ctx, w->packer, k, w->old, w->oldsize, w->new, 0);
+}
+
+int bspatch(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *oldfile, 
+	struct bsdiff_stream *newfile,
+	struct bsdiff_patch_packer *packer)
+{
+	int ret, i;
+	int64_t oldsize, newsize;
+	const uint8_t *old;
+	uint8_t *old_owned = NULL, *new = NULL;
+	int64_t count = 0, new_start, new_end, old_start;
+	struct bsdiff_patch_packer probe = { 0 };
+	struct frame_workers w = { 0 };
+
+	assert(oldfile->get_mode(oldfile->state) == BSDIFF_MODE_READ);
+	assert(newfile->get_mode(newfile->state) == BSDIFF_MODE_WRITE);
+	assert(packer->get_mode(packer->state) == BSDIFF_MODE_READ);
+
+	//load old file, borrowing its buffer if possible
+	if ((ret = bsdiff_load_stream(oldfile, &old, &oldsize, &old_owned)) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(ret, "load oldfile");
+	
+	// check and read newfile data to new buffer
+	if (packer->read_new_size(packer->state, &newsize) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read new size from patch_packer");
+	if (newsize >= SIZE_MAX)
+		HANDLE_ERROR(BSDIFF_SIZE_TOO_LARGE, "newfile is too large");
+	if ((new = malloc((size_t)(newsize + 1))) == NULL)
+		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for new");
+
+	/* The frames of a framed patch in memory are applied concurrently */
+	if (ctx->num_threads > 1 && packer->read_frame_count != NULL &&
+		packer->read_frame_count(packer->state, &count) == BSDIFF_SUCCESS && count > 1 &&
+		packer->open_frame(packer->state, 0, &probe, &new_start, &new_end, &old_start) == BSDIFF_SUCCESS)
+	{
+		bsdiff_close_patch_packer(&probe);
+		w.ctx = ctx;
+		w.packer = packer;
+		w.old = old;
+		w.oldsize = oldsize;
+		w.new = new;
+		w.count = count;
+		w.workers = (count < ctx->num_threads) ? (int)count : ctx->num_threads;
+		if ((w.ret = malloc(sizeof(int) * (size_t)w.workers)) == NULL)
+			HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for frame workers");
+		bsdiff_parallel_for(w.workers, frame_worker, &w);
+		for (i = 0; i < w.workers; i++) {
+			if (w.ret[i] != BSDIFF_SUCCESS)
+				HANDLE_ERROR(w.ret[i], "apply frames");
+		}
+	} else {
+		if ((ret = apply_entries(ctx, packer, old, oldsize, new, newsize, 0)) != BSDIFF_SUCCESS)
+			goto cleanup;
+	}
+
 	/* Write the new file */
 	if ((newfile->write(newfile->state, new, (size_t)newsize) != BSDIFF_SUCCESS) ||
 		(newfile->flush(newfile->state) != BSDIFF_SUCCESS))
@@ -131,8 +243,127 @@ int bspatch(
 	ret = BSDIFF_SUCCESS;
 
 cleanup:
+	if (w.ret != NULL) { free(w.ret); }
 	if (new != NULL) { free(new); }
-	if (old != NULL) { free(old); }
+	if (old_owned != NULL) { free(old_owned); }
+
+	return ret;
+}
+
+int bspatch_range(
+	struct bsdiff_ctx *ctx,
+	struct bsdiff_stream *oldfile,
+	struct bsdiff_patch_packer *packer,
+	int64_t offset,
+	void *buffer,
+	size_t size)
+{
+	int ret;
+	int64_t oldsize, newsize, count, lo, hi, mid, k;
+	int64_t new_start, new_end, old_start, end, frame_size;
+	const uint8_t *old;
+	uint8_t *old_owned = NULL, *tmp = NULL, *out = (uint8_t*)buffer;
+
+	assert(oldfile->get_mode(oldfile->state) == BSDIFF_MODE_READ);
+	assert(packer->get_mode(packer->state) == BSDIFF_MODE_READ);
+
+	if (packer->read_frame_count == NULL || packer->open_frame == NULL)
+		HANDLE_ERROR(BSDIFF_INVALID_ARG, "the patch isn't framed");
+	if (packer->read_new_size(packer->state, &newsize) != BSDIFF_SUCCESS ||
+		packer->read_frame_count(packer->state, &count) != BSDIFF_SUCCESS)
+	{
+		HANDLE_ERROR(BSDIFF_FILE_ERROR, "read new size from patch_packer");
+	}
+	end = offset + (int64_t)size;
+	if (offset < 0 || (int64_t)size < 0 || end > newsize)
+		HANDLE_ERROR(BSDIFF_INVALID_ARG, "range out of the new file");
+	if (size == 0) {
+		ret = BSDIFF_SUCCESS;
+		goto cleanup;
+	}
+
+	//load old file, borrowing its buffer if possible
+	if ((ret = bsdiff_load_stream(oldfile, &old, &oldsize, &old_owned)) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(ret, "load oldfile");
+
+	/* Find the frame holding offset, the first one is the largest */
+	if ((ret = packer->open_frame(packer->state, 0, NULL, &new_start, &frame_size, &old_start)) != BSDIFF_SUCCESS)
+		HANDLE_ERROR(ret, "read frame index");
+	lo = 0; hi = count - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if ((ret = packer->open_frame(packer->state, mid, NULL, &new_start, &new_end, &old_start)) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(ret, "read frame index");
+		if (new_start <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	/* Frames inside the range are rebuilt in place, the partial ones at its
+	   ends into a temporary buffer */
+	for (k = lo; k < count; k++) {
+		if ((ret = packer->open_frame(packer->state, k, NULL, &new_start, &new_end, &old_start)) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(ret, "read frame index");
+		if (new_start >= end)
+			break;
+		if (new_start >= offset && new_end <= end) {
+			if ((ret = apply_frame(ctx, packer, k, old, oldsize, out, offset)) != BSDIFF_SUCCESS)
+				HANDLE_ERROR(ret, "apply frame");
+			continue;
+		}
+		if (tmp == NULL && (tmp = malloc((size_t)frame_size + 1)) == NULL)
+			HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "malloc for frame");
+		if ((ret = apply_frame(ctx, packer, k, old, oldsize, tmp, new_start)) != BSDIFF_SUCCESS)
+			HANDLE_ERROR(ret, "apply frame");
+		lo = (new_start > offset) ? new_start : offset;
+		hi = (new_end < end) ? new_end : end;
+		memcpy(out + (lo - offset), tmp + (lo - new_start), (size_t)(hi - lo));
+	}
+
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	if (tmp != NULL) { free(tmp); }
+	if (old_owned != NULL) { free(old_owned); }
+
+	return ret;
+}
+
+int bspatch_buffers(
+	struct bsdiff_ctx *ctx,
+	const void *old,
+	size_t oldsize,
+	const void *patch,
+	size_t patchsize,
+	void **new,
+	size_t *newsize)
+{
+	int ret;
+	struct bsdiff_stream oldfile = { 0 }, newfile = { 0 }, patchfile = { 0 };
+	struct bsdiff_patch_packer packer = { 0 };
+
+	*new = NULL;
+	*newsize = 0;
+
+	if ((bsdiff_open_memory_stream(BSDIFF_MODE_READ, old, oldsize, &oldfile) != BSDIFF_SUCCESS) ||
+		(bsdiff_open_memory_stream(BSDIFF_MODE_READ, patch, patchsize, &patchfile) != BSDIFF_SUCCESS) ||
+		(bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, NULL, 0, &newfile) != BSDIFF_SUCCESS) ||
+		(bsdiff_open_patch_reader(&patchfile, &packer) != BSDIFF_SUCCESS))
+	{
+		HANDLE_ERROR(BSDIFF_OUT_OF_MEMORY, "open memory streams");
+	}
+
+	if ((ret = bspatch(ctx, &oldfile, &newfile, &packer)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	bsdiff_memory_stream_detach(&newfile, new, newsize);
+
+cleanup:
+	bsdiff_close_patch_packer(&packer);
+	bsdiff_close_stream(&newfile);
+	bsdiff_close_stream(&patchfile);
+	bsdiff_close_stream(&oldfile);
 
 	return ret;
 }
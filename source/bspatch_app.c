@@ -26,6 +26,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "bsdiff.h"
 
 static void log_error(void *opaque, const char *errmsg)
@@ -34,96 +36,95 @@ static void log_error(void *opaque, const char *errmsg)
 	fprintf(stderr, "%s", errmsg);
 }
 
-int main(int argc,char * argv[])
+/* Inputs are mapped into memory when possible, falling back to stdio */
+static int open_input(const char *filename, struct bsdiff_stream *stream)
 {
-	return testMemory(argc, argv);
+	if (bsdiff_open_mmap_stream(filename, stream) == BSDIFF_SUCCESS)
+		return BSDIFF_SUCCESS;
+	return bsdiff_open_file_stream(BSDIFF_MODE_READ, filename, stream);
 }
-int testMemory(int argc, char* argv[]) {
-	int ret = 1;
-	struct bsdiff_stream oldfile = { 0 }, newfile = { 0 }, patchfile = { 0 };
-	struct bsdiff_ctx ctx = { 0 };
-	struct bsdiff_patch_packer packer = { 0 };
-	argc = 4;
-    argv[1] = "D:\\temp\\v1.c";
-	argv[2] = "D:\\temp\\v2.c";
-	argv[3] = "D:\\temp\\patch";
-	
-	if (argc != 4) {
-		fprintf(stderr, "usage: %s oldfile newfile patchfile\n", argv[0]);
-		goto cleanup;
-	}
 
-	if ((ret = bsdiff_open_memory_stream(BSDIFF_MODE_READ, argv[1], strlen(argv[1]), &oldfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open oldfile: %s\n", argv[1]);
-		goto cleanup;
-	}
-	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_WRITE, argv[2], &newfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open newfile: %s\n", argv[2]);
-		goto cleanup;
-	}
-	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_READ, argv[3], &patchfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open patchfile: %s\n", argv[3]);
-		goto cleanup;
-	}
-	if ((ret = bsdiff_open_bz2_patch_packer(BSDIFF_MODE_READ, &patchfile, &packer)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't create BZ2 patch packer\n");
-		goto cleanup;
-	}
-	
-	ctx.log_error = log_error;
-
-	if ((ret = bspatch(&ctx, &oldfile, &newfile, &packer)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "bspatch failed: %d\n", ret);
-		goto cleanup;
-	}
-
-cleanup:
-	bsdiff_close_patch_packer(&packer);
-	bsdiff_close_stream(&patchfile);
-	bsdiff_close_stream(&newfile);
-	bsdiff_close_stream(&oldfile);
-
-	return ret;
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-j threads] [-r offset length] oldfile newfile patchfile\n", prog);
 }
-int testFile(int argc, char* argv[]) {
+
+int main(int argc, char *argv[])
+{
 	int ret = 1;
+	int i;
 	struct bsdiff_stream oldfile = { 0 }, newfile = { 0 }, patchfile = { 0 };
 	struct bsdiff_ctx ctx = { 0 };
 	struct bsdiff_patch_packer packer = { 0 };
-	argc = 4;
-	argv[1] = "c:\\Users\\liudongdong\\OneDrive - tju.edu.cn\\\\android_sourcecode\\c_code\\bsdiff\\testdata\\simple\\v1.c";
-	argv[2] = "c:\\Users\\liudongdong\\OneDrive - tju.edu.cn\\\\android_sourcecode\\c_code\\bsdiff\\testdata\\simple\\v3.c";
-	argv[3] = "c:\\Users\\liudongdong\\OneDrive - tju.edu.cn\\\\android_sourcecode\\c_code\\bsdiff\\testdata\\simple\\patch";
-	if (argc != 4) {
-		fprintf(stderr, "usage: %s oldfile newfile patchfile\n", argv[0]);
-		goto cleanup;
+	int64_t offset = -1, length = 0;  /* the whole new file */
+	void *range = NULL;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			ctx.num_threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-r") == 0 && i + 2 < argc) {
+			offset = atoll(argv[++i]);
+			length = atoll(argv[++i]);
+			if (offset < 0 || length < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - i != 3) {
+		usage(argv[0]);
+		return 1;
 	}
 
-	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_READ, argv[1], &oldfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open oldfile: %s\n", argv[1]);
+	if ((ret = open_input(argv[i], &oldfile)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "can't open oldfile: %s\n", argv[i]);
 		goto cleanup;
 	}
-	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_WRITE, argv[2], &newfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open newfile: %s\n", argv[2]);
+	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_WRITE, argv[i + 1], &newfile)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "can't open newfile: %s\n", argv[i + 1]);
 		goto cleanup;
 	}
-	if ((ret = bsdiff_open_file_stream(BSDIFF_MODE_READ, argv[3], &patchfile)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't open patchfile: %s\n", argv[3]);
+	if ((ret = open_input(argv[i + 2], &patchfile)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "can't open patchfile: %s\n", argv[i + 2]);
 		goto cleanup;
 	}
-	if ((ret = bsdiff_open_bz2_patch_packer(BSDIFF_MODE_READ, &patchfile, &packer)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "can't create BZ2 patch packer\n");
+	if ((ret = bsdiff_open_patch_reader(&patchfile, &packer)) != BSDIFF_SUCCESS) {
+		fprintf(stderr, "can't create patch packer\n");
 		goto cleanup;
 	}
 
 	ctx.log_error = log_error;
 
-	if ((ret = bspatch(&ctx, &oldfile, &newfile, &packer)) != BSDIFF_SUCCESS) {
-		fprintf(stderr, "bspatch failed: %d\n", ret);
-		goto cleanup;
+	if (offset < 0) {
+		if ((ret = bspatch(&ctx, &oldfile, &newfile, &packer)) != BSDIFF_SUCCESS) {
+			fprintf(stderr, "bspatch failed: %d\n", ret);
+			goto cleanup;
+		}
+	} else {
+		/* only the range of the new file, from a framed patch */
+		if ((range = malloc((size_t)length + 1)) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			ret = BSDIFF_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+		if ((ret = bspatch_range(&ctx, &oldfile, &packer, offset, range, (size_t)length)) != BSDIFF_SUCCESS) {
+			fprintf(stderr, "bspatch_range failed: %d\n", ret);
+			goto cleanup;
+		}
+		if ((newfile.write(newfile.state, range, (size_t)length) != BSDIFF_SUCCESS) ||
+			(newfile.flush(newfile.state) != BSDIFF_SUCCESS))
+		{
+			fprintf(stderr, "can't write newfile: %s\n", argv[i + 1]);
+			ret = BSDIFF_FILE_ERROR;
+			goto cleanup;
+		}
 	}
 
 cleanup:
+	free(range);
 	bsdiff_close_patch_packer(&packer);
 	bsdiff_close_stream(&patchfile);
 	bsdiff_close_stream(&newfile);
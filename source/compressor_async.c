@@ -0,0 +1,253 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+
+/*
+ * A compressor which runs another one on a worker thread. Writes are copied
+ * into one of two chunks, a full chunk is handed to the worker, which
+ * compresses it while the caller fills the other one. flush() hands over
+ * the last chunk and waits for the worker to flush the inner compressor.
+ * If the worker can't be started, the inner compressor is called directly.
+ */
+#define ASYNC_CHUNK_LEN (1 << 20)
+
+struct async_compressor
+{
+	struct bsdiff_compressor inner;
+	uint8_t *chunk[2];
+	size_t len[2];     /* bytes in chunk i */
+	int full[2];       /* chunk i is handed to the worker */
+	int cur;           /* the chunk filled by the caller */
+	int finish;        /* no more chunks, the worker flushes inner and exits */
+	int stop;          /* the worker exits without flushing */
+	int done;          /* the worker has exited */
+	int ret;           /* first error of the inner compressor */
+	int started;
+#if defined(_WIN32)
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE cond;
+	HANDLE thread;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+#endif
+};
+
+#if defined(_WIN32)
+#define LOCK(a)      EnterCriticalSection(&(a)->lock)
+#define UNLOCK(a)    LeaveCriticalSection(&(a)->lock)
+#define WAIT(a)      SleepConditionVariableCS(&(a)->cond, &(a)->lock, INFINITE)
+#define BROADCAST(a) WakeAllConditionVariable(&(a)->cond)
+#else
+#define LOCK(a)      pthread_mutex_lock(&(a)->lock)
+#define UNLOCK(a)    pthread_mutex_unlock(&(a)->lock)
+#define WAIT(a)      pthread_cond_wait(&(a)->cond, &(a)->lock)
+#define BROADCAST(a) pthread_cond_broadcast(&(a)->cond)
+#endif
+
+#if defined(_WIN32)
+static unsigned __stdcall async_compressor_main(void *p)
+#else
+static void *async_compressor_main(void *p)
+#endif
+{
+	struct async_compressor *a = (struct async_compressor*)p;
+	int i = 0, ret = BSDIFF_SUCCESS;
+
+	LOCK(a);
+	for (;;) {
+		/* chunks are handed over alternately, starting with chunk 0 */
+		while (!a->full[i] && !a->finish && !a->stop)
+			WAIT(a);
+		if (a->stop || !a->full[i])
+			break;
+		UNLOCK(a);
+		if (ret == BSDIFF_SUCCESS)
+			ret = a->inner.write(a->inner.state, a->chunk[i], a->len[i]);
+		LOCK(a);
+		if (ret != BSDIFF_SUCCESS && a->ret == BSDIFF_SUCCESS)
+			a->ret = ret;
+		a->full[i] = 0;
+		a->len[i] = 0;
+		BROADCAST(a);
+		i ^= 1;
+	}
+	if (!a->stop && ret == BSDIFF_SUCCESS) {
+		UNLOCK(a);
+		ret = a->inner.flush(a->inner.state);
+		LOCK(a);
+		if (ret != BSDIFF_SUCCESS && a->ret == BSDIFF_SUCCESS)
+			a->ret = ret;
+	}
+	a->done = 1;
+	BROADCAST(a);
+	UNLOCK(a);
+
+	return 0;
+}
+
+static int async_compressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct async_compressor *a = (struct async_compressor*)state;
+	int ret;
+
+	if ((ret = a->inner.init(a->inner.state, stream)) != BSDIFF_SUCCESS)
+		return ret;
+
+	a->chunk[0] = malloc(ASYNC_CHUNK_LEN);
+	a->chunk[1] = malloc(ASYNC_CHUNK_LEN);
+	if (a->chunk[0] == NULL || a->chunk[1] == NULL)
+		return BSDIFF_SUCCESS;  /* synchronous */
+
+#if defined(_WIN32)
+	InitializeCriticalSection(&a->lock);
+	InitializeConditionVariable(&a->cond);
+	a->thread = (HANDLE)_beginthreadex(NULL, 0, async_compressor_main, a, 0, NULL);
+	if (a->thread == 0) {
+		DeleteCriticalSection(&a->lock);
+		return BSDIFF_SUCCESS;
+	}
+#else
+	if (pthread_mutex_init(&a->lock, NULL) != 0)
+		return BSDIFF_SUCCESS;
+	if (pthread_cond_init(&a->cond, NULL) != 0) {
+		pthread_mutex_destroy(&a->lock);
+		return BSDIFF_SUCCESS;
+	}
+	if (pthread_create(&a->thread, NULL, async_compressor_main, a) != 0) {
+		pthread_cond_destroy(&a->cond);
+		pthread_mutex_destroy(&a->lock);
+		return BSDIFF_SUCCESS;
+	}
+#endif
+	a->started = 1;
+
+	return BSDIFF_SUCCESS;
+}
+
+/* Hands the current chunk to the worker and waits for the other one */
+static int async_compressor_handover(struct async_compressor *a)
+{
+	int ret;
+
+	LOCK(a);
+	a->full[a->cur] = 1;
+	BROADCAST(a);
+	a->cur ^= 1;
+	while (a->full[a->cur] && a->ret == BSDIFF_SUCCESS)
+		WAIT(a);
+	ret = a->ret;
+	UNLOCK(a);
+
+	return ret;
+}
+
+static int async_compressor_write(void *state, const void *buffer, size_t size)
+{
+	struct async_compressor *a = (struct async_compressor*)state;
+	const uint8_t *p = (const uint8_t*)buffer;
+	size_t n;
+	int ret;
+
+	if (!a->started)
+		return a->inner.write(a->inner.state, buffer, size);
+
+	while (size > 0) {
+		n = ASYNC_CHUNK_LEN - a->len[a->cur];
+		if (n > size)
+			n = size;
+		memcpy(a->chunk[a->cur] + a->len[a->cur], p, n);
+		a->len[a->cur] += n;
+		p += n;
+		size -= n;
+		if (a->len[a->cur] == ASYNC_CHUNK_LEN) {
+			if ((ret = async_compressor_handover(a)) != BSDIFF_SUCCESS)
+				return ret;
+		}
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static void async_compressor_join(struct async_compressor *a)
+{
+#if defined(_WIN32)
+	WaitForSingleObject(a->thread, INFINITE);
+	CloseHandle(a->thread);
+	DeleteCriticalSection(&a->lock);
+#else
+	pthread_join(a->thread, NULL);
+	pthread_cond_destroy(&a->cond);
+	pthread_mutex_destroy(&a->lock);
+#endif
+	a->started = 0;
+}
+
+static int async_compressor_flush(void *state)
+{
+	struct async_compressor *a = (struct async_compressor*)state;
+	int ret;
+
+	if (!a->started)
+		return a->inner.flush(a->inner.state);
+
+	LOCK(a);
+	if (a->len[a->cur] > 0)
+		a->full[a->cur] = 1;
+	a->finish = 1;
+	BROADCAST(a);
+	while (!a->done)
+		WAIT(a);
+	ret = a->ret;
+	UNLOCK(a);
+	async_compressor_join(a);
+
+	return ret;
+}
+
+static void async_compressor_close(void *state)
+{
+	struct async_compressor *a = (struct async_compressor*)state;
+
+	if (a->started) {
+		LOCK(a);
+		a->stop = 1;
+		BROADCAST(a);
+		UNLOCK(a);
+		async_compressor_join(a);
+	}
+	bsdiff_close_compressor(&(a->inner));
+	free(a->chunk[0]);
+	free(a->chunk[1]);
+	free(a);
+}
+
+int bsdiff_create_async_compressor(
+	struct bsdiff_compressor *enc,
+	struct bsdiff_compressor *inner)
+{
+	struct async_compressor *state;
+
+	state = malloc(sizeof(struct async_compressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->inner = *inner;
+
+	memset(enc, 0, sizeof(*enc));
+	enc->state = state;
+	enc->init = async_compressor_init;
+	enc->write = async_compressor_write;
+	enc->flush = async_compressor_flush;
+	enc->close = async_compressor_close;
+
+	return BSDIFF_SUCCESS;
+}
@@ -13,6 +13,8 @@ struct bz2_compressor
 	/*bz_stream*/
 	bz_stream bzstrm;
 	int bzerr;
+	/*block size of bzip2 in 100k units, 1..9*/
+	int level;
 	/*buffer to temperally save data, if full, wite to disk*/
 	char buf[5000];
 };
@@ -39,7 +41,7 @@ static int bz2_compressor_init(void *state, struct bsdiff_stream *stream)
 	enc->bzstrm.bzalloc = NULL;
 	enc->bzstrm.bzfree = NULL;
 	enc->bzstrm.opaque = NULL;
-	if (BZ2_bzCompressInit(&(enc->bzstrm), 9, 0, 30) != BZ_OK)
+	if (BZ2_bzCompressInit(&(enc->bzstrm), enc->level, 0, 30) != BZ_OK)
 		return BSDIFF_ERROR;
 	enc->bzstrm.avail_in = 0;
 	enc->bzstrm.next_in = NULL;
@@ -169,10 +171,12 @@ static void bz2_compressor_close(void *state)
 	enc->write = bz2_compressor_write;
 	enc->flush = bz2_compressor_flush;
 	enc->close = bz2_compressor_close;
+ * @param level block size of bzip2 (1..9), other values select 9
  * @return int 
  */
 int bsdiff_create_bz2_compressor(
-	struct bsdiff_compressor *enc)
+	struct bsdiff_compressor *enc,
+	int level)
 {
 	struct bz2_compressor *state;
 
@@ -181,6 +185,7 @@ int bsdiff_create_bz2_compressor(
 		return BSDIFF_OUT_OF_MEMORY;
 	state->initialized = 0;
 	state->strm = NULL;
+	state->level = (level >= 1 && level <= 9) ? level : 9;
 
 	memset(enc, 0, sizeof(*enc));
 	enc->state = state;
@@ -191,3 +196,246 @@ int bsdiff_create_bz2_compressor(
 
 	return BSDIFF_SUCCESS;
 }
+
+/*
+ * Parallel variant, in the manner of pbzip2: the input is cut into chunks
+ * of one bzip2 block, each compressed into an independent bzip2 stream,
+ * `threads` chunks at a time. The output is the concatenation of the
+ * streams, which bzip2 and bz2_decompressor_read() read as one.
+ *
+ * A bzip2 block holds 100000 * level - 19 symbols after the initial run
+ * length encoding (runs of 4 to 255 equal bytes take 5 symbols), so the
+ * chunks are cut where the streaming compressor would end its blocks, and
+ * the blocks come out the same. A chunk is also cut after
+ * PARALLEL_CHUNK_FACTOR blocks worth of input, which bounds the memory on
+ * long runs.
+ */
+#define PARALLEL_CHUNK_FACTOR 8
+
+struct bz2_parallel_compressor
+{
+	int initialized;
+	struct bsdiff_stream *strm;
+	int level;
+	int threads;
+	size_t symmax;      /* symbols of a bzip2 block */
+	size_t chunk_max;   /* input bytes of a chunk at most */
+	uint8_t *in;        /* input of up to `threads` chunks */
+	size_t incap;
+	size_t inlen;
+	size_t *ends;       /* end of the complete chunks in `in` */
+	int nchunks;
+	/* run length encoding of the current chunk, as in BZ2_bzCompress */
+	size_t start;       /* first byte of the current chunk */
+	size_t scanned;     /* bytes of `in` scanned so far */
+	size_t nsym;        /* symbols of the current chunk */
+	int rl_ch;          /* byte of the pending run, 256 if none */
+	int rl_len;
+	uint8_t *out;       /* `threads` compressed chunks */
+	size_t out_cap;     /* capacity of a compressed chunk */
+	unsigned int *outlen;
+	int *bzerr;
+	int64_t written;    /* chunks written so far */
+	int error;
+};
+
+static int bz2_parallel_compressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct bz2_parallel_compressor *enc = (struct bz2_parallel_compressor*)state;
+
+	if (enc->initialized)
+		return BSDIFF_ERROR;
+
+	if (stream->read != NULL || stream->write == NULL || stream->flush == NULL)
+		return BSDIFF_INVALID_ARG;
+	enc->strm = stream;
+
+	enc->symmax = (size_t)enc->level * 100000 - 19;
+	enc->chunk_max = enc->symmax * PARALLEL_CHUNK_FACTOR;
+	enc->incap = enc->chunk_max * (size_t)enc->threads;
+	enc->out_cap = enc->chunk_max + enc->chunk_max / 100 + 600;
+	enc->in = malloc(enc->incap);
+	enc->ends = malloc(sizeof(size_t) * (size_t)enc->threads);
+	enc->out = malloc(enc->out_cap * (size_t)enc->threads);
+	enc->outlen = malloc(sizeof(unsigned int) * (size_t)enc->threads);
+	enc->bzerr = malloc(sizeof(int) * (size_t)enc->threads);
+	if (!enc->in || !enc->ends || !enc->out || !enc->outlen || !enc->bzerr)
+		return BSDIFF_OUT_OF_MEMORY;
+	enc->inlen = 0;
+	enc->nchunks = 0;
+	enc->start = 0;
+	enc->scanned = 0;
+	enc->nsym = 0;
+	enc->rl_ch = 256;
+	enc->rl_len = 0;
+	enc->written = 0;
+	enc->error = 0;
+
+	enc->initialized = 1;
+
+	return BSDIFF_SUCCESS;
+}
+
+/* Cuts the scanned input into chunks, until `threads` chunks are complete */
+static void bz2_parallel_compressor_cut(struct bz2_parallel_compressor *enc)
+{
+	int ch;
+
+	while (enc->nchunks < enc->threads) {
+		/* the block is full before the next byte */
+		if (enc->nsym >= enc->symmax || enc->scanned - enc->start >= enc->chunk_max) {
+			enc->ends[enc->nchunks++] = enc->scanned;
+			enc->start = enc->scanned;
+			enc->nsym = 0;
+			enc->rl_ch = 256;
+			enc->rl_len = 0;
+			continue;
+		}
+		if (enc->scanned == enc->inlen)
+			break;
+		ch = enc->in[enc->scanned++];
+		if (ch != enc->rl_ch || enc->rl_len == 255) {
+			if (enc->rl_ch < 256)
+				enc->nsym += (enc->rl_len < 4) ? (size_t)enc->rl_len : 5;
+			enc->rl_ch = ch;
+			enc->rl_len = 1;
+		} else {
+			enc->rl_len++;
+		}
+	}
+}
+
+static void bz2_parallel_compress_chunk(void *arg, int i)
+{
+	struct bz2_parallel_compressor *enc = (struct bz2_parallel_compressor*)arg;
+	size_t start = (i == 0) ? 0 : enc->ends[i - 1];
+
+	enc->outlen[i] = (unsigned int)enc->out_cap;
+	enc->bzerr[i] = BZ2_bzBuffToBuffCompress((char*)enc->out + enc->out_cap * (size_t)i,
+		&(enc->outlen[i]), (char*)enc->in + start, (unsigned int)(enc->ends[i] - start),
+		enc->level, 0, 30);
+}
+
+/* Compresses the complete chunks concurrently, writes them in order and
+   moves the rest of the input to the front */
+static int bz2_parallel_compressor_batch(struct bz2_parallel_compressor *enc)
+{
+	int i, n = enc->nchunks;
+	size_t end;
+
+	bsdiff_parallel_for(n, bz2_parallel_compress_chunk, enc);
+
+	for (i = 0; i < n; i++) {
+		if (enc->bzerr[i] != BZ_OK)
+			return BSDIFF_ERROR;
+		if (enc->strm->write(enc->strm->state, enc->out + enc->out_cap * (size_t)i,
+			enc->outlen[i]) != BSDIFF_SUCCESS)
+		{
+			return BSDIFF_ERROR;
+		}
+	}
+	enc->written += n;
+
+	end = enc->ends[n - 1];
+	memmove(enc->in, enc->in + end, enc->inlen - end);
+	enc->inlen -= end;
+	enc->scanned -= end;
+	enc->start -= end;
+	enc->nchunks = 0;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int bz2_parallel_compressor_write(void *state, const void *buffer, size_t size)
+{
+	struct bz2_parallel_compressor *enc = (struct bz2_parallel_compressor*)state;
+	const uint8_t *p = (const uint8_t*)buffer;
+	size_t n;
+
+	if (!enc->initialized || enc->error)
+		return BSDIFF_ERROR;
+
+	while (size > 0) {
+		n = enc->incap - enc->inlen;
+		if (n > size)
+			n = size;
+		memcpy(enc->in + enc->inlen, p, n);
+		enc->inlen += n;
+		p += n;
+		size -= n;
+		bz2_parallel_compressor_cut(enc);
+		if (enc->nchunks == enc->threads && bz2_parallel_compressor_batch(enc) != BSDIFF_SUCCESS) {
+			enc->error = 1;
+			return BSDIFF_ERROR;
+		}
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int bz2_parallel_compressor_flush(void *state)
+{
+	struct bz2_parallel_compressor *enc = (struct bz2_parallel_compressor*)state;
+
+	if (!enc->initialized || enc->error)
+		return BSDIFF_ERROR;
+
+	/* the rest is the last chunk, an empty input is still one (empty) stream */
+	while (enc->inlen > 0 || enc->written == 0) {
+		bz2_parallel_compressor_cut(enc);
+		if (enc->nchunks < enc->threads && (enc->start < enc->inlen || enc->nchunks == 0))
+			enc->ends[enc->nchunks++] = enc->inlen;
+		if (bz2_parallel_compressor_batch(enc) != BSDIFF_SUCCESS) {
+			enc->error = 1;
+			return BSDIFF_ERROR;
+		}
+	}
+	if (enc->strm->flush(enc->strm->state) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+
+	return BSDIFF_SUCCESS;
+}
+
+static void bz2_parallel_compressor_close(void *state)
+{
+	struct bz2_parallel_compressor *enc = (struct bz2_parallel_compressor*)state;
+
+	free(enc->in);
+	free(enc->ends);
+	free(enc->out);
+	free(enc->outlen);
+	free(enc->bzerr);
+	free(enc);
+}
+/**
+ * @brief create a bsdiff_compressor which compresses `threads` blocks of
+ *   bzip2 at a time, into independent streams
+ *
+ * @param enc bsdiff_compressor point address, to be create and initialized
+ * @param level block size of bzip2 (1..9), other values select 9
+ * @param threads number of blocks compressed concurrently
+ * @return int
+ */
+int bsdiff_create_bz2_parallel_compressor(
+	struct bsdiff_compressor *enc,
+	int level,
+	int threads)
+{
+	struct bz2_parallel_compressor *state;
+
+	state = malloc(sizeof(struct bz2_parallel_compressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->level = (level >= 1 && level <= 9) ? level : 9;
+	state->threads = (threads > 1) ? threads : 1;
+
+	memset(enc, 0, sizeof(*enc));
+	enc->state = state;
+	enc->init = bz2_parallel_compressor_init;
+	enc->write = bz2_parallel_compressor_write;
+	enc->flush = bz2_parallel_compressor_flush;
+	enc->close = bz2_parallel_compressor_close;
+
+	return BSDIFF_SUCCESS;
+}
@@ -0,0 +1,80 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* A compressor which writes its input as is, for the store packer. */
+struct store_compressor
+{
+	/*bsdiff_stream structure*/
+	struct bsdiff_stream *strm;
+};
+
+static int store_compressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct store_compressor *enc = (struct store_compressor*)state;
+
+	if (enc->strm != NULL)
+		return BSDIFF_ERROR;
+	if (stream->read != NULL || stream->write == NULL || stream->flush == NULL)
+		return BSDIFF_INVALID_ARG;
+	enc->strm = stream;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int store_compressor_write(void *state, const void *buffer, size_t size)
+{
+	struct store_compressor *enc = (struct store_compressor*)state;
+
+	if (enc->strm == NULL)
+		return BSDIFF_ERROR;
+	if (size == 0)
+		return BSDIFF_SUCCESS;
+	return enc->strm->write(enc->strm->state, buffer, size);
+}
+
+static int store_compressor_flush(void *state)
+{
+	struct store_compressor *enc = (struct store_compressor*)state;
+
+	if (enc->strm == NULL)
+		return BSDIFF_ERROR;
+	return enc->strm->flush(enc->strm->state);
+}
+
+static void store_compressor_close(void *state)
+{
+	free(state);
+}
+/**
+ * @brief create a store bsdiff_compressor
+ *
+ * @param enc bsdiff_compressor point address, to be create and initialized
+ * @param level unused
+ * @param threads unused
+ * @return int
+ */
+int bsdiff_create_store_compressor(
+	struct bsdiff_compressor *enc,
+	int level,
+	int threads)
+{
+	struct store_compressor *state;
+
+	(void)level;
+	(void)threads;
+	state = malloc(sizeof(struct store_compressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	state->strm = NULL;
+
+	memset(enc, 0, sizeof(*enc));
+	enc->state = state;
+	enc->init = store_compressor_init;
+	enc->write = store_compressor_write;
+	enc->flush = store_compressor_flush;
+	enc->close = store_compressor_close;
+
+	return BSDIFF_SUCCESS;
+}
@@ -0,0 +1,191 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zstd.h>
+
+struct zstd_compressor
+{
+	/*flag of initialized, 1: initialized, 0: not initialized */
+	int initialized;
+	/*bsdiff_stream structure*/
+	struct bsdiff_stream *strm;
+	ZSTD_CCtx *cctx;
+	/*compression level of zstd*/
+	int level;
+	/*worker threads of zstd, 0: compress on the calling thread*/
+	int workers;
+	/*set when an error occurred*/
+	int failed;
+	/*buffer to temperally save data, if full, wite to disk*/
+	char buf[16384];
+};
+/**
+ * @brief
+ *
+ * @param state point address of zstd_compressor
+ * @param stream point address of bsdiff_stream
+ * @return int
+ * 	BSDIFF_ERROR: failed
+ * 	BSDIFF_SUCCESS: ok
+ */
+static int zstd_compressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct zstd_compressor *enc = (struct zstd_compressor*)state;
+
+	if (enc->initialized)
+		return BSDIFF_ERROR;
+
+	if (stream->read != NULL || stream->write == NULL || stream->flush == NULL)
+		return BSDIFF_INVALID_ARG;
+	enc->strm = stream;
+
+	enc->cctx = ZSTD_createCCtx();
+	if (enc->cctx == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	if (ZSTD_isError(ZSTD_CCtx_setParameter(enc->cctx, ZSTD_c_compressionLevel, enc->level)))
+		return BSDIFF_ERROR;
+	/* fails if libzstd is built without threads, then compress on this thread */
+	if (enc->workers > 0)
+		ZSTD_CCtx_setParameter(enc->cctx, ZSTD_c_nbWorkers, enc->workers);
+
+	enc->failed = 0;
+
+	enc->initialized = 1;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief compress input and write out every full output buffer
+ *
+ * @param enc point address of zstd_compressor
+ * @param input the data to be compressed
+ * @param mode ZSTD_e_continue, or ZSTD_e_end to finish the frame
+ * @return int
+ */
+static int zstd_compressor_run(struct zstd_compressor *enc, ZSTD_inBuffer *input, ZSTD_EndDirective mode)
+{
+	ZSTD_outBuffer output;
+	size_t remaining;
+
+	while (1) {
+		output.dst = enc->buf;
+		output.size = sizeof(enc->buf);
+		output.pos = 0;
+		remaining = ZSTD_compressStream2(enc->cctx, &output, input, mode);
+		if (ZSTD_isError(remaining)) {
+			enc->failed = 1;
+			return BSDIFF_ERROR;
+		}
+		if (output.pos > 0) {
+			if (enc->strm->write(enc->strm->state, enc->buf, output.pos) != BSDIFF_SUCCESS) {
+				enc->failed = 1;
+				return BSDIFF_ERROR;
+			}
+		}
+		if (mode == ZSTD_e_end) {
+			if (remaining == 0)
+				return BSDIFF_SUCCESS;
+		} else if (input->pos == input->size) {
+			return BSDIFF_SUCCESS;
+		}
+	}
+}
+/**
+ * @brief
+ *
+ * @param state point address of zstd_compressor
+ * @param buffer memery buffer wait to be compressed
+ * @param size size of buffer
+ * @return int
+ *  BSDIFF_SUCCESS: OK
+ *  BSDIFF_ERROR: error
+ */
+static int zstd_compressor_write(void *state, const void *buffer, size_t size)
+{
+	struct zstd_compressor *enc = (struct zstd_compressor*)state;
+	ZSTD_inBuffer input;
+
+	if (!enc->initialized || enc->failed)
+		return BSDIFF_ERROR;
+	if (size == 0)
+		return BSDIFF_SUCCESS;
+
+	input.src = buffer;
+	input.size = size;
+	input.pos = 0;
+	return zstd_compressor_run(enc, &input, ZSTD_e_continue);
+}
+/**
+ * @brief finish the zstd frame and flush the stream
+ *
+ * @param state point address of zstd_compressor
+ * @return int
+ */
+static int zstd_compressor_flush(void *state)
+{
+	struct zstd_compressor *enc = (struct zstd_compressor*)state;
+	ZSTD_inBuffer input = { NULL, 0, 0 };
+
+	if (!enc->initialized || enc->failed)
+		return BSDIFF_ERROR;
+
+	if (zstd_compressor_run(enc, &input, ZSTD_e_end) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (enc->strm->flush(enc->strm->state) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief free the zstd context and the zstd_compressor
+ *
+ * @param state point address of zstd_compressor
+ *
+ */
+static void zstd_compressor_close(void *state)
+{
+	struct zstd_compressor *enc = (struct zstd_compressor*)state;
+
+	ZSTD_freeCCtx(enc->cctx);
+
+	/* free the state */
+	free(enc);
+}
+/**
+ * @brief create a zstd bsdiff_compressor
+ *
+ * @param enc bsdiff_compressor point address, to be create and initialized
+ * @param level compression level of zstd, clamped to the levels of libzstd
+ * @param threads threads compressing the stream, 1 compresses on the
+ *   calling thread
+ * @return int
+ */
+int bsdiff_create_zstd_compressor(
+	struct bsdiff_compressor *enc,
+	int level,
+	int threads)
+{
+	struct zstd_compressor *state;
+
+	state = malloc(sizeof(struct zstd_compressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	state->initialized = 0;
+	state->strm = NULL;
+	state->cctx = NULL;
+	if (level < ZSTD_minCLevel())
+		level = ZSTD_minCLevel();
+	if (level > ZSTD_maxCLevel())
+		level = ZSTD_maxCLevel();
+	state->level = level;
+	state->workers = (threads > 1) ? threads : 0;
+
+	memset(enc, 0, sizeof(*enc));
+	enc->state = state;
+	enc->init = zstd_compressor_init;
+	enc->write = zstd_compressor_write;
+	enc->flush = zstd_compressor_flush;
+	enc->close = zstd_compressor_close;
+
+	return BSDIFF_SUCCESS;
+}
@@ -50,6 +50,33 @@ static int bz2_decompressor_init(void *state, struct bsdiff_stream *stream)
 
 	return BSDIFF_SUCCESS;
 }
+/**
+ * @brief reset the BZ2 decompress state for the next stream, keeping the
+ *   pending input
+ *
+ * @param dec point address of bz2_decompressor
+ * @return int
+ */
+static int bz2_decompressor_restart(struct bz2_decompressor *dec)
+{
+	char *next_in = dec->bzstrm.next_in;
+	unsigned int avail_in = dec->bzstrm.avail_in;
+	char *next_out = dec->bzstrm.next_out;
+	unsigned int avail_out = dec->bzstrm.avail_out;
+
+	BZ2_bzDecompressEnd(&(dec->bzstrm));
+	dec->initialized = 0;
+	if (BZ2_bzDecompressInit(&(dec->bzstrm), 0, 0) != BZ_OK)
+		return BSDIFF_ERROR;
+	dec->initialized = 1;
+	dec->bzstrm.next_in = next_in;
+	dec->bzstrm.avail_in = avail_in;
+	dec->bzstrm.next_out = next_out;
+	dec->bzstrm.avail_out = avail_out;
+	dec->bzerr = BZ_OK;
+
+	return BSDIFF_SUCCESS;
+}
 /**
  * @brief bz_decompress data to buffer
  * 
@@ -102,9 +129,21 @@ static int bz2_decompressor_read(void *state, void *buffer, size_t size, size_t
 		/* update readed */
 		*readed += old_avail_out - dec->bzstrm.avail_out;
 
-		/* the end of compressed stream was detected */
-		if (dec->bzerr == BZ_STREAM_END)
-			return BSDIFF_END_OF_FILE;
+		/* the end of compressed stream was detected, another one may
+		   follow (see bsdiff_create_bz2_parallel_compressor) */
+		if (dec->bzerr == BZ_STREAM_END) {
+			if (dec->bzstrm.avail_in == 0) {
+				ret = dec->strm->read(dec->strm->state, dec->buf, sizeof(dec->buf), &cb);
+				if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+					return BSDIFF_ERROR;
+				if (cb == 0)
+					return BSDIFF_END_OF_FILE;
+				dec->bzstrm.next_in = dec->buf;
+				dec->bzstrm.avail_in = (unsigned int)cb;
+			}
+			if (bz2_decompressor_restart(dec) != BSDIFF_SUCCESS)
+				return BSDIFF_ERROR;
+		}
 		/* all output buffer has been consumed */
 		if (dec->bzstrm.avail_out == 0)
 			return BSDIFF_SUCCESS;
@@ -0,0 +1,75 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* A decompressor which reads its input as is, for the store packer. */
+struct store_decompressor
+{
+	/*bsdiff_stream structure*/
+	struct bsdiff_stream *strm;
+};
+
+static int store_decompressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct store_decompressor *dec = (struct store_decompressor*)state;
+
+	if (dec->strm != NULL)
+		return BSDIFF_ERROR;
+	dec->strm = stream;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int store_decompressor_read(void *state, void *buffer, size_t size, size_t *readed)
+{
+	struct store_decompressor *dec = (struct store_decompressor*)state;
+	int ret;
+	size_t cb;
+
+	*readed = 0;
+
+	if (dec->strm == NULL)
+		return BSDIFF_ERROR;
+
+	/* the stream may return less than asked before its end */
+	while (*readed < size) {
+		ret = dec->strm->read(dec->strm->state, (uint8_t*)buffer + *readed, size - *readed, &cb);
+		*readed += cb;
+		if (ret != BSDIFF_SUCCESS)
+			return ret;
+		if (cb == 0)
+			return BSDIFF_END_OF_FILE;
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static void store_decompressor_close(void *state)
+{
+	free(state);
+}
+/**
+ * @brief create a store bsdiff_decompressor
+ *
+ * @param dec bsdiff_decompressor point address, to be create and initialized
+ * @return int
+ */
+int bsdiff_create_store_decompressor(
+	struct bsdiff_decompressor *dec)
+{
+	struct store_decompressor *state;
+
+	state = malloc(sizeof(struct store_decompressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	state->strm = NULL;
+
+	memset(dec, 0, sizeof(*dec));
+	dec->state = state;
+	dec->init = store_decompressor_init;
+	dec->read = store_decompressor_read;
+	dec->close = store_decompressor_close;
+
+	return BSDIFF_SUCCESS;
+}
@@ -0,0 +1,159 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zstd.h>
+
+struct zstd_decompressor
+{
+	/*flag of initialized, 1: initialized, 0: not initialized */
+	int initialized;
+	/*bsdiff_stream structure*/
+	struct bsdiff_stream *strm;
+	ZSTD_DCtx *dctx;
+	ZSTD_inBuffer input;
+	/*0 at the end of a frame, another one may follow*/
+	size_t hint;
+	/*the last call filled the output, zstd may hold more of it*/
+	int pending;
+	/*set at the end of the stream, or when an error occurred*/
+	int ret;
+	/*buffer to temperally save data, if full, wite to outer buffer*/
+	char buf[16384];
+};
+/**
+ * @brief
+ *
+ * @param state point address of zstd_decompressor
+ * @param stream point address of bsdiff_stream
+ * @return int
+ * 	BSDIFF_ERROR: failed
+ * 	BSDIFF_SUCCESS: ok
+ */
+static int zstd_decompressor_init(void *state, struct bsdiff_stream *stream)
+{
+	struct zstd_decompressor *dec = (struct zstd_decompressor*)state;
+
+	if (dec->initialized)
+		return BSDIFF_ERROR;
+
+	dec->strm = stream;
+
+	dec->dctx = ZSTD_createDCtx();
+	if (dec->dctx == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	dec->input.src = dec->buf;
+	dec->input.size = 0;
+	dec->input.pos = 0;
+	dec->hint = 1;
+	dec->pending = 0;
+	dec->ret = BSDIFF_SUCCESS;
+
+	dec->initialized = 1;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief zstd decompress data to buffer
+ *
+ * @param state point address of zstd_decompressor
+ * @param buffer memery buffer store the decompressed data
+ * @param size  size of required read data
+ * @param readed size of readed data
+ * @return int
+ * 	BSDIFF_SUCCESS: OK
+ *  BSDIFF_ERROR: error
+ *  BSDIFF_END_OF_FILE
+ */
+static int zstd_decompressor_read(void *state, void *buffer, size_t size, size_t *readed)
+{
+	struct zstd_decompressor *dec = (struct zstd_decompressor*)state;
+	ZSTD_outBuffer output;
+	int ret;
+	size_t cb;
+
+	*readed = 0;
+
+	if (!dec->initialized)
+		return BSDIFF_ERROR;
+	if (dec->ret != BSDIFF_SUCCESS)
+		return dec->ret;
+	if (size == 0)
+		return BSDIFF_SUCCESS;
+
+	output.dst = buffer;
+	output.size = size;
+	output.pos = 0;
+
+	while (output.pos < output.size) {
+		/* input buffer is empty */
+		if (dec->input.pos == dec->input.size && !dec->pending) {
+			ret = dec->strm->read(dec->strm->state, dec->buf, sizeof(dec->buf), &cb);
+			if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) {
+				dec->ret = BSDIFF_ERROR;
+				break;
+			}
+			if (cb == 0) {
+				/* the stream must end with a complete frame */
+				dec->ret = (dec->hint == 0) ? BSDIFF_END_OF_FILE : BSDIFF_ERROR;
+				break;
+			}
+			dec->input.size = cb;
+			dec->input.pos = 0;
+		}
+
+		/* decompress some amount of data, frames follow each other */
+		dec->hint = ZSTD_decompressStream(dec->dctx, &output, &(dec->input));
+		if (ZSTD_isError(dec->hint)) {
+			dec->ret = BSDIFF_ERROR;
+			break;
+		}
+		dec->pending = (output.pos == output.size);
+	}
+
+	*readed = output.pos;
+	if (output.pos == output.size)
+		return BSDIFF_SUCCESS;
+	return dec->ret;
+}
+/**
+ * @brief free the zstd context and the zstd_decompressor
+ *
+ * @param state point address of zstd_decompressor
+ *
+ */
+static void zstd_decompressor_close(void *state)
+{
+	struct zstd_decompressor *dec = (struct zstd_decompressor*)state;
+
+	ZSTD_freeDCtx(dec->dctx);
+
+	/* free the state */
+	free(dec);
+}
+/**
+ * @brief create a zstd bsdiff_decompressor
+ *
+ * @param dec bsdiff_decompressor point address, to be create and initialized
+ * @return int
+ */
+int bsdiff_create_zstd_decompressor(
+	struct bsdiff_decompressor *dec)
+{
+	struct zstd_decompressor *state;
+
+	state = malloc(sizeof(struct zstd_decompressor));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	state->initialized = 0;
+	state->strm = NULL;
+	state->dctx = NULL;
+
+	memset(dec, 0, sizeof(*dec));
+	dec->state = state;
+	dec->init = zstd_decompressor_init;
+	dec->read = zstd_decompressor_read;
+	dec->close = zstd_decompressor_close;
+
+	return BSDIFF_SUCCESS;
+}
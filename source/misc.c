@@ -1,6 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 #include "bsdiff.h"
 #include "bsdiff_private.h"
 
@@ -23,6 +29,8 @@ static const char* err_code_str(int errcode)
 		return "corrupt patch data";
 	case BSDIFF_SIZE_TOO_LARGE:
 		return "size is too large";
+	case BSDIFF_CANCELED:
+		return "canceled";
 	default:
 		return "unknown error";
 	}
@@ -69,6 +77,53 @@ void bsdiff_close_stream(
 	}
 }
 
+static const uint8_t empty_buffer[1];
+
+int bsdiff_load_stream(
+	struct bsdiff_stream *stream,
+	const uint8_t **pbuffer,
+	int64_t *psize,
+	uint8_t **owned)
+{
+	const void *buffer;
+	size_t size, cb;
+	int64_t n;
+	uint8_t *p;
+
+	*owned = NULL;
+
+	if (stream->get_buffer != NULL &&
+		stream->get_buffer(stream->state, &buffer, &size) == BSDIFF_SUCCESS)
+	{
+		/* Never hand out NULL, even for empty buffers */
+		*pbuffer = (size > 0) ? (const uint8_t*)buffer : empty_buffer;
+		*psize = (int64_t)size;
+		return BSDIFF_SUCCESS;
+	}
+
+	if ((stream->seek(stream->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
+		(stream->tell(stream->state, &n) != BSDIFF_SUCCESS) ||
+		(stream->seek(stream->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS))
+	{
+		return BSDIFF_FILE_ERROR;
+	}
+	if (n >= SIZE_MAX)
+		return BSDIFF_SIZE_TOO_LARGE;
+	/* Allocate n+1 bytes instead of n bytes to ensure
+		that we never try to malloc(0) and get a NULL pointer */
+	if ((p = malloc((size_t)(n + 1))) == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	if (stream->read(stream->state, p, (size_t)n, &cb) != BSDIFF_SUCCESS) {
+		free(p);
+		return BSDIFF_FILE_ERROR;
+	}
+
+	*pbuffer = p;
+	*psize = n;
+	*owned = p;
+	return BSDIFF_SUCCESS;
+}
+
 void bsdiff_close_compressor(
 	struct bsdiff_compressor *enc)
 {
@@ -95,3 +150,19 @@ void bsdiff_close_patch_packer(
 		memset(packer, 0, sizeof(*packer));
 	}
 }
+
+void bsdiff_free(void *buffer)
+{
+	free(buffer);
+}
+
+int64_t bsdiff_clock_ms(void)
+{
+#if defined(_WIN32)
+	return (int64_t)GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
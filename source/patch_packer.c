@@ -0,0 +1,903 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+int bsdiff_create_bz2_compressor(struct bsdiff_compressor *enc, int level);
+int bsdiff_create_bz2_parallel_compressor(struct bsdiff_compressor *enc, int level, int threads);
+int bsdiff_create_bz2_decompressor(struct bsdiff_decompressor *dec);
+int bsdiff_create_store_compressor(struct bsdiff_compressor *enc, int level, int threads);
+int bsdiff_create_store_decompressor(struct bsdiff_decompressor *dec);
+#if defined(BSDIFF_WITH_ZSTD)
+int bsdiff_create_zstd_compressor(struct bsdiff_compressor *enc, int level, int threads);
+int bsdiff_create_zstd_decompressor(struct bsdiff_decompressor *dec);
+#endif
+
+/*
+ * The codecs of the patch. Every patch has the layout of BSDIFF40 (see
+ * codec_patch_packer_read_new_size), the magic tells the codec of its
+ * three blocks, so that a reader opened with any codec reads them all.
+ */
+static int create_bz2_compressor(struct bsdiff_compressor *enc, int level, int threads)
+{
+	if (threads > 1)
+		return bsdiff_create_bz2_parallel_compressor(enc, level, threads);
+	return bsdiff_create_bz2_compressor(enc, level);
+}
+
+static const struct bsdiff_codec bz2_codec = {
+	"BSDIFF40",
+	{ { 1, 1, 1 }, { 2, 2, 2 }, { 3, 3, 3 }, { 4, 4, 4 }, { 5, 5, 5 },
+	  { 6, 6, 6 }, { 7, 7, 7 }, { 8, 8, 8 }, { 9, 9, 9 } },
+	create_bz2_compressor,
+	bsdiff_create_bz2_decompressor,
+	0
+};
+
+static const struct bsdiff_codec store_codec = {
+	"BSSTOR40",
+	{ { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 },
+	  { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 } },
+	bsdiff_create_store_compressor,
+	bsdiff_create_store_decompressor,
+	1
+};
+
+#if defined(BSDIFF_WITH_ZSTD)
+/* The control and diff blocks gain little above level 9, which uses far
+   less memory than the high levels. The extra block, the new data, does. */
+static const struct bsdiff_codec zstd_codec = {
+	"BSZSTD40",
+	{ { 1, 1, 1 }, { 2, 2, 2 }, { 3, 3, 3 }, { 5, 5, 5 }, { 7, 7, 7 },
+	  { 9, 9, 9 }, { 9, 9, 12 }, { 9, 9, 16 }, { 9, 9, 19 } },
+	bsdiff_create_zstd_compressor,
+	bsdiff_create_zstd_decompressor,
+	0
+};
+#endif
+
+/* indexed by BSDIFF_CODEC_* */
+static const struct bsdiff_codec *codecs[] = {
+	&bz2_codec,
+#if defined(BSDIFF_WITH_ZSTD)
+	&zstd_codec,
+#else
+	NULL,
+#endif
+	&store_codec,
+};
+
+const struct bsdiff_codec *bsdiff_get_codec(int codec)
+{
+	if (codec < 0 || codec >= (int)(sizeof(codecs) / sizeof(codecs[0])))
+		return NULL;
+	return codecs[codec];
+}
+
+const struct bsdiff_codec *bsdiff_find_codec(const void *magic)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+		if (codecs[i] != NULL && memcmp(magic, codecs[i]->magic, 8) == 0)
+			return codecs[i];
+	}
+	return NULL;
+}
+
+/**
+ * @brief calculate the size of 8 bytes，one byte equal to 8 bits
+ * 
+ * @param buf 
+ * @return int64_t 
+ */
+int64_t bsdiff_offtin(const uint8_t *buf)
+{
+	int64_t y;
+
+	y = buf[7] & 0x7F;
+	y = y * 256; y += buf[6];
+	y = y * 256; y += buf[5];
+	y = y * 256; y += buf[4];
+	y = y * 256; y += buf[3];
+	y = y * 256; y += buf[2];
+	y = y * 256; y += buf[1];
+	y = y * 256; y += buf[0];
+	// flag position
+	if (buf[7] & 0x80)
+		y = -y;
+
+	return y;
+}
+
+void bsdiff_offtout(int64_t x, uint8_t *buf)
+{
+	int64_t y;
+
+	if (x < 0)
+		y = -x;
+	else
+		y = x;
+
+				 buf[0] = y % 256; y -= buf[0];
+	y = y / 256; buf[1] = y % 256; y -= buf[1];
+	y = y / 256; buf[2] = y % 256; y -= buf[2];
+	y = y / 256; buf[3] = y % 256; y -= buf[3];
+	y = y / 256; buf[4] = y % 256; y -= buf[4];
+	y = y / 256; buf[5] = y % 256; y -= buf[5];
+	y = y / 256; buf[6] = y % 256; y -= buf[6];
+	y = y / 256; buf[7] = y % 256;
+
+	if (x < 0)
+		buf[7] |= 0x80;
+}
+
+struct codec_patch_packer
+{
+	struct bsdiff_stream *stream;
+	int mode;
+
+	int64_t new_size;
+
+	int64_t header_x;
+	int64_t header_y;
+	int64_t header_z;
+
+	struct bsdiff_stream cpf;
+	struct bsdiff_stream dpf;
+	struct bsdiff_stream epf;
+	struct bsdiff_decompressor cpf_dec;  // control block
+	struct bsdiff_decompressor dpf_dec;  // diff block
+	struct bsdiff_decompressor epf_dec;  // extra block
+	const uint8_t *dmap;  // the rest of a stored diff block in memory, or NULL
+	const uint8_t *emap;  // the rest of a stored extra block in memory, or NULL
+	int64_t dmaplen;
+	int64_t emaplen;
+
+	const struct bsdiff_codec *codec;  //codec of the blocks, detected from the magic in read mode
+	int levels[3];  //native levels of the control, diff and extra blocks, see codec_patch_packer_set_level
+	int threads;  //threads compressing each block, see codec_patch_packer_set_threads
+	struct bsdiff_compressor enc;   //control block, compressed straight into stream
+	struct bsdiff_compressor denc;  //diff block, compressed into dspill
+	struct bsdiff_compressor eenc;  //extra block, compressed into espill
+	struct bsdiff_stream dspill;  //a temporary file, or memory if none can be created
+	struct bsdiff_stream espill;
+	int64_t dblen;  //bytes of diff data written so far
+	int64_t eblen;  //bytes of extra data written so far
+	int flush_ret[3];  //results of flush_compressor
+};
+/**
+ * @brief read codec_patch_packer, and get the new size
+ * 
+ * @param state point address of codec_patch_packer
+ * @param size store the sizeof(newfile)
+ * @return int 
+ */
+static int codec_patch_packer_read_new_size(void *state, int64_t *size)
+{
+	int ret;
+	uint8_t header[32];
+	size_t cb;
+	int64_t bzctrllen, bzdatalen, newsize;
+	int64_t read_start, read_end;
+	const void *buffer;
+	size_t buffer_size;
+
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	if (packer->new_size >= 0) {
+		*size = packer->new_size;
+		return BSDIFF_SUCCESS;
+	}
+	assert(packer->new_size == -1);  
+
+	/*
+	File format:
+		0		8	"BSDIFF40" (bzip2), "BSZSTD40" (zstd) or "BSSTOR40" (store)
+		8		8	X
+		16		8	Y
+		24		8	sizeof(newfile)
+		32		X	codec(control block)
+		32+X	Y	codec(diff block)
+		32+X+Y	???	codec(extra block)
+	with control block a set of triples (x,y,z) meaning "add x bytes
+	from oldfile to x bytes from the diff block; copy y bytes from the
+	extra block; seek forwards in oldfile by z bytes".
+	*/
+
+	/* Read header */
+	ret = packer->stream->read(packer->stream->state, header, 32, &cb);
+	if (ret != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	/* Check for appropriate magic, it selects the codec */
+	if (cb != 32)
+		return BSDIFF_CORRUPT_PATCH;
+	packer->codec = bsdiff_find_codec(header);
+	if (packer->codec == NULL)
+		return BSDIFF_CORRUPT_PATCH;
+
+	/* Read lengths from header */
+	bzctrllen = bsdiff_offtin(header + 8);
+	bzdatalen = bsdiff_offtin(header + 16);
+	newsize = bsdiff_offtin(header + 24);
+	if ((bzctrllen < 0) || (bzdatalen < 0) || (newsize < 0))
+		return BSDIFF_CORRUPT_PATCH;
+
+	/* Open substreams and create decompressors */
+	/* control block */
+	read_start = 32;
+	read_end = read_start + bzctrllen;
+	if (bsdiff_open_substream(packer->stream, read_start, read_end, &(packer->cpf)) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	if (packer->codec->create_decompressor(&(packer->cpf_dec)) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (packer->cpf_dec.init(packer->cpf_dec.state, &(packer->cpf)) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	/* diff block */
+	read_start = read_end;
+	read_end = read_start + bzdatalen;
+	if (bsdiff_open_substream(packer->stream, read_start, read_end, &(packer->dpf)) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	if (packer->codec->create_decompressor(&(packer->dpf_dec)) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (packer->dpf_dec.init(packer->dpf_dec.state, &(packer->dpf)) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	/* extra block */
+	read_start = read_end;
+	if ((packer->stream->seek(packer->stream->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
+		(packer->stream->tell(packer->stream->state, &read_end) != BSDIFF_SUCCESS))
+	{
+		return BSDIFF_FILE_ERROR;
+	}
+	if (bsdiff_open_substream(packer->stream, read_start, read_end, &(packer->epf)) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	if (packer->codec->create_decompressor(&(packer->epf_dec)) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (packer->epf_dec.init(packer->epf_dec.state, &(packer->epf)) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+
+	/* Stored blocks of a patch in memory are used in place */
+	if (packer->codec->stored && packer->stream->get_buffer != NULL &&
+		packer->stream->get_buffer(packer->stream->state, &buffer, &buffer_size) == BSDIFF_SUCCESS &&
+		(int64_t)buffer_size == read_end)
+	{
+		packer->dmap = (const uint8_t*)buffer + 32 + bzctrllen;
+		packer->dmaplen = bzdatalen;
+		packer->emap = packer->dmap + bzdatalen;
+		packer->emaplen = read_end - read_start;
+	}
+
+	packer->new_size = newsize;
+
+	*size = packer->new_size;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief get the header_x, header_y, header_z of the Entry_head data
+ * 
+ * @param state point address of codec_patch_packer
+ * @param diff packer->header_x;
+ * @param extra  packer->header_y;
+ * @param seek  packer->header_z;
+ * @return int 
+ */
+static int codec_patch_packer_read_entry_header(
+	void *state, int64_t *diff, int64_t *extra, int64_t *seek)
+{
+	int ret;
+	uint8_t buf[24];
+	size_t cb;
+
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x == 0 && packer->header_y == 0);
+
+	ret = packer->cpf_dec.read(packer->cpf_dec.state, buf, 24, &cb);
+	if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != 24))
+		return BSDIFF_ERROR;
+	packer->header_x = bsdiff_offtin(buf);
+	packer->header_y = bsdiff_offtin(buf + 8);
+	packer->header_z = bsdiff_offtin(buf + 16);
+
+	*diff  = packer->header_x;
+	*extra = packer->header_y;
+	*seek  = packer->header_z;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief read_entry_diff from packer->dpf_dec.state and save to buffer
+ * 
+ * @param state point address of codec_patch_packer
+ * @param buffer store diff block content
+ * @param size the size of diff block size
+ * @param readed 
+ * @return int 
+ */
+static int codec_patch_packer_read_entry_diff(
+	void *state, void *buffer, size_t size, size_t *readed)
+{
+	int ret;
+	int64_t cb;
+
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x >= 0);
+
+	*readed = 0;
+
+	cb = (int64_t)size;
+	if (packer->header_x < cb)
+		cb = packer->header_x;
+	if (cb <= 0)
+		return BSDIFF_END_OF_FILE;
+
+	if (packer->dmap != NULL) {
+		if (cb > packer->dmaplen)
+			return BSDIFF_CORRUPT_PATCH;
+		memcpy(buffer, packer->dmap, (size_t)cb);
+		packer->dmap += cb;
+		packer->dmaplen -= cb;
+		packer->header_x -= cb;
+		*readed = (size_t)cb;
+		return BSDIFF_SUCCESS;
+	}
+
+	ret = packer->dpf_dec.read(packer->dpf_dec.state, buffer, (size_t)cb, readed);
+	packer->header_x -= (int64_t)(*readed);
+	return ret;
+}
+/**
+ * @brief read data from packer->epf_dec.state, and save to buffer
+ * 
+ * @param state point address of codec_patch_packer
+ * @param buffer store extra block content
+ * @param size size of extra block content
+ * @param readed 
+ * @return int 
+ */
+static int codec_patch_packer_read_entry_extra(
+	void *state, void *buffer, size_t size, size_t *readed)
+{
+	int ret;
+	int64_t cb;
+
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_y >= 0);
+
+	*readed = 0;
+
+	cb = (int64_t)size;
+	if (packer->header_y < cb)
+		cb = packer->header_y;
+	if (cb <= 0)
+		return BSDIFF_END_OF_FILE;
+
+	if (packer->emap != NULL) {
+		if (cb > packer->emaplen)
+			return BSDIFF_CORRUPT_PATCH;
+		memcpy(buffer, packer->emap, (size_t)cb);
+		packer->emap += cb;
+		packer->emaplen -= cb;
+		packer->header_y -= cb;
+		*readed = (size_t)cb;
+		return BSDIFF_SUCCESS;
+	}
+
+	ret = packer->epf_dec.read(packer->epf_dec.state, buffer, (size_t)cb, readed);
+	packer->header_y -= (int64_t)(*readed);
+	return ret;
+}
+/**
+ * @brief return a pointer to the next size bytes of the diff of the current
+ *   entry, if the diff block is stored in memory
+ *
+ * @param state point address of codec_patch_packer
+ * @param size bytes to be mapped, at most the rest of the diff of the entry
+ * @param buffer the mapped bytes
+ * @return int
+ */
+static int codec_patch_packer_map_entry_diff(
+	void *state, size_t size, const void **buffer)
+{
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	if (packer->dmap == NULL)
+		return BSDIFF_ERROR;
+	if ((int64_t)size > packer->header_x || (int64_t)size > packer->dmaplen)
+		return BSDIFF_CORRUPT_PATCH;
+	*buffer = packer->dmap;
+	packer->dmap += size;
+	packer->dmaplen -= (int64_t)size;
+	packer->header_x -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief return a pointer to the next size bytes of the extra of the current
+ *   entry, if the extra block is stored in memory
+ *
+ * @param state point address of codec_patch_packer
+ * @param size bytes to be mapped, at most the rest of the extra of the entry
+ * @param buffer the mapped bytes
+ * @return int
+ */
+static int codec_patch_packer_map_entry_extra(
+	void *state, size_t size, const void **buffer)
+{
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	if (packer->emap == NULL)
+		return BSDIFF_ERROR;
+	if ((int64_t)size > packer->header_y || (int64_t)size > packer->emaplen)
+		return BSDIFF_CORRUPT_PATCH;
+	*buffer = packer->emap;
+	packer->emap += size;
+	packer->emaplen -= (int64_t)size;
+	packer->header_y -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief open a spill stream for a compressed block, a temporary file or,
+ *   if none can be created, memory
+ *
+ * @param spill the stream to be opened
+ * @return int
+ */
+static int open_spill(struct bsdiff_stream *spill)
+{
+	if (bsdiff_open_tmpfile_stream(spill) == BSDIFF_SUCCESS)
+		return BSDIFF_SUCCESS;
+	return bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, NULL, 0, spill);
+}
+/**
+ * @brief create a compressor of block i writing to stream, which compresses
+ *   on its own thread so that the three blocks are compressed concurrently,
+ *   unless the codec stores them
+ *
+ * @param packer point address of codec_patch_packer
+ * @param i the block, 0: control, 1: diff, 2: extra
+ * @param enc the compressor to be created
+ * @param stream where the compressed data goes
+ * @return int
+ */
+static int open_compressor(struct codec_patch_packer *packer, int i,
+	struct bsdiff_compressor *enc, struct bsdiff_stream *stream)
+{
+	struct bsdiff_compressor inner;
+
+	if (packer->codec->create_compressor(&inner, packer->levels[i], packer->threads) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	if (packer->codec->stored) {
+		*enc = inner;
+	} else if (bsdiff_create_async_compressor(enc, &inner) != BSDIFF_SUCCESS) {
+		bsdiff_close_compressor(&inner);
+		return BSDIFF_ERROR;
+	}
+	if (enc->init(enc->state, stream) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief flush compressor i of the packer (control, diff, extra), run by
+ *   bsdiff_parallel_for()
+ *
+ * @param arg point address of codec_patch_packer
+ * @param i
+ */
+static void flush_compressor(void *arg, int i)
+{
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)arg;
+	struct bsdiff_compressor *enc = (i == 0) ? &(packer->enc) :
+		(i == 1) ? &(packer->denc) : &(packer->eenc);
+
+	packer->flush_ret[i] = enc->flush(enc->state);
+}
+/**
+ * @brief append the content of a spill stream to the patch
+ *
+ * @param packer point address of codec_patch_packer
+ * @param spill the spill stream, switched to read mode if it is a file
+ * @return int
+ */
+static int append_spill(struct codec_patch_packer *packer, struct bsdiff_stream *spill)
+{
+	uint8_t buf[16384];
+	const void *buffer;
+	size_t size;
+	int ret;
+
+	/* a memory spill is written at once */
+	if (spill->get_buffer != NULL) {
+		if (spill->get_buffer(spill->state, &buffer, &size) != BSDIFF_SUCCESS)
+			return BSDIFF_ERROR;
+		return packer->stream->write(packer->stream->state, buffer, size);
+	}
+
+	if ((spill->seek(spill->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS) ||
+		(spill->set_mode(spill, BSDIFF_MODE_READ) != BSDIFF_MODE_READ))
+	{
+		return BSDIFF_FILE_ERROR;
+	}
+	do {
+		ret = spill->read(spill->state, buf, sizeof(buf), &size);
+		if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+			return BSDIFF_FILE_ERROR;
+		if (packer->stream->write(packer->stream->state, buf, size) != BSDIFF_SUCCESS)
+			return BSDIFF_FILE_ERROR;
+	} while (ret == BSDIFF_SUCCESS);
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief write a pseudo header, initialize the compressors of the control
+ *   block (straight to the patch) and of the diff and extra blocks (into
+ *   their spill streams)
+ * 
+ * @param state point address of codec_patch_packer
+ * @param size packer->new_size, new file size
+ * @return int 
+ */
+static int codec_patch_packer_write_new_size(
+	void *state, int64_t size)
+{
+	uint8_t header[32] = { 0 };
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size == -1);
+	assert(size >= 0);
+
+	/* Write a pseudo header */
+	if (packer->stream->write(packer->stream->state, header, 32) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	/* Initialize compressors */
+	if ((open_spill(&(packer->dspill)) != BSDIFF_SUCCESS) ||
+		(open_spill(&(packer->espill)) != BSDIFF_SUCCESS))
+	{
+		return BSDIFF_FILE_ERROR;
+	}
+	if ((open_compressor(packer, 0, &(packer->enc), packer->stream) != BSDIFF_SUCCESS) ||
+		(open_compressor(packer, 1, &(packer->denc), &(packer->dspill)) != BSDIFF_SUCCESS) ||
+		(open_compressor(packer, 2, &(packer->eenc), &(packer->espill)) != BSDIFF_SUCCESS))
+	{
+		return BSDIFF_ERROR;
+	}
+	packer->dblen = 0;
+	packer->eblen = 0;
+
+	packer->new_size = size;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief write head and compress
+ * 
+ * @param state point address of codec_patch_packer
+ * @param diff diff size
+ * @param extra  extra size
+ * @param seek  seek size
+ * @return int 
+ */
+static int codec_patch_packer_write_entry_header(
+	void *state, int64_t diff, int64_t extra, int64_t seek)
+{
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(diff >= 0);
+	assert(extra >= 0);
+
+	assert(packer->header_x == 0 && packer->header_y == 0);
+	packer->header_x = diff;
+	packer->header_y = extra;
+	packer->header_z = seek;
+
+	/* Write a triple */
+	uint8_t buf[24];
+	bsdiff_offtout(packer->header_x, buf);
+	bsdiff_offtout(packer->header_y, buf + 8);
+	bsdiff_offtout(packer->header_z, buf + 16);
+	int ret = packer->enc.write(packer->enc.state, buf, 24);
+	if (ret != BSDIFF_SUCCESS)
+		return ret;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief compress diff data of the current entry into the diff spill
+ * 
+ * @param state point address of bsdiff_patch_packer 
+ * @param buffer 
+ * @param size 
+ * @return int 
+ */
+static int codec_patch_packer_write_entry_diff(
+	void *state, const void *buffer, size_t size)
+{
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	if ((int64_t)size > packer->header_x)
+		return BSDIFF_INVALID_ARG;
+	if (packer->dblen + (int64_t)size > packer->new_size)
+		return BSDIFF_INVALID_ARG;
+	if (packer->denc.write(packer->denc.state, buffer, size) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	packer->dblen += (int64_t)size;
+	packer->header_x -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int codec_patch_packer_set_level(void *state, int level)
+{
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+
+	if (packer->new_size != -1)
+		return BSDIFF_ERROR;
+	if (level < 1 || level > 9)
+		return BSDIFF_INVALID_ARG;
+	memcpy(packer->levels, packer->codec->presets[level - 1], sizeof(packer->levels));
+
+	return BSDIFF_SUCCESS;
+}
+
+static int codec_patch_packer_set_threads(void *state, int threads)
+{
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+
+	if (packer->new_size != -1)
+		return BSDIFF_ERROR;
+	if (threads < 1)
+		return BSDIFF_INVALID_ARG;
+	packer->threads = threads;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int codec_patch_packer_write_entry_extra(
+	void *state, const void *buffer, size_t size)
+{
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	if ((int64_t)size > packer->header_y)
+		return BSDIFF_INVALID_ARG;
+	if (packer->eblen + (int64_t)size > packer->new_size)
+		return BSDIFF_INVALID_ARG;
+	if (packer->eenc.write(packer->eenc.state, buffer, size) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	packer->eblen += (int64_t)size;
+	packer->header_y -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief finish the three compressors, append the diff and extra blocks
+ *   behind the control block and rewrite the header
+ *
+ * @param state point address of codec_patch_packer
+ * @return int
+ */
+static int codec_patch_packer_flush(void *state)
+{
+	uint8_t header[32] = { 0 };
+	int64_t patchsize, patchsize2;
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x == 0 && packer->header_y == 0);
+
+	memcpy(header, packer->codec->magic, 8);
+	bsdiff_offtout(packer->new_size, header + 24);
+
+	/* Finish the three blocks concurrently */
+	bsdiff_parallel_for(3, flush_compressor, packer);
+	if ((packer->flush_ret[0] != BSDIFF_SUCCESS) ||
+		(packer->flush_ret[1] != BSDIFF_SUCCESS) ||
+		(packer->flush_ret[2] != BSDIFF_SUCCESS))
+	{
+		return BSDIFF_ERROR;
+	}
+
+	/* Compute size of compressed ctrl data */
+	if (packer->stream->tell(packer->stream->state, &patchsize) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	bsdiff_offtout(patchsize - 32, header + 8);
+
+	/* Write compressed diff data */
+	if (append_spill(packer, &(packer->dspill)) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	/* Compute size of compressed diff data */
+	if (packer->stream->tell(packer->stream->state, &patchsize2) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	bsdiff_offtout(patchsize2 - patchsize, header + 16);
+
+	/* Write compressed extra data */
+	if (append_spill(packer, &(packer->espill)) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	/* Seek to the beginning, (re)write the header */
+	if ((packer->stream->seek(packer->stream->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS) ||
+		(packer->stream->write(packer->stream->state, header, 32) != BSDIFF_SUCCESS) ||
+		(packer->stream->flush(packer->stream->state) != BSDIFF_SUCCESS))
+	{
+		return BSDIFF_FILE_ERROR;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static void codec_patch_packer_close(void *state)
+{
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	
+	if (packer->mode == BSDIFF_MODE_READ) {
+		bsdiff_close_decompressor(&(packer->cpf_dec));
+		bsdiff_close_decompressor(&(packer->dpf_dec));
+		bsdiff_close_decompressor(&(packer->epf_dec));
+		bsdiff_close_stream(&(packer->cpf));
+		bsdiff_close_stream(&(packer->dpf));
+		bsdiff_close_stream(&(packer->epf));
+	} else {
+		bsdiff_close_compressor(&(packer->enc));
+		bsdiff_close_compressor(&(packer->denc));
+		bsdiff_close_compressor(&(packer->eenc));
+		bsdiff_close_stream(&(packer->dspill));
+		bsdiff_close_stream(&(packer->espill));
+	}
+
+	bsdiff_close_stream(packer->stream);
+
+	free(packer);
+}
+
+static int codec_patch_packer_getmode(void *state)
+{
+	struct codec_patch_packer *packer = (struct codec_patch_packer*)state;
+	return packer->mode;
+}
+/**
+ * @brief set the mode of bsdiff_patch_packer, and reset the operation functions piont address
+ * 
+ * @param bsdiff_packer point address of bsdiff_patch_packer
+ * @param mode 
+ *   BSDIFF_MODE_READ  0
+ *   BSDIFF_MODE_WRITE 1
+ * @return int codec_packer->mode
+ */
+static int codec_patch_packer_setmode(void* bsdiff_packer, int mode)
+{
+	struct bsdiff_patch_packer* packer = (struct bsdiff_patch_packer*)bsdiff_packer;
+	struct codec_patch_packer* codec_packer = (struct codec_patch_packer*)packer->state;
+	struct bsdiff_stream* bstream = (struct bsdiff_stream*)codec_packer->stream;
+	codec_packer->mode = mode;
+	bstream->set_mode(bstream, mode);
+	if (mode == BSDIFF_MODE_READ) {
+		packer->read_new_size = codec_patch_packer_read_new_size;
+		packer->read_entry_header = codec_patch_packer_read_entry_header;
+		packer->read_entry_diff = codec_patch_packer_read_entry_diff;
+		packer->read_entry_extra = codec_patch_packer_read_entry_extra;
+		packer->map_entry_diff = codec_patch_packer_map_entry_diff;
+		packer->map_entry_extra = codec_patch_packer_map_entry_extra;
+	}
+	else {
+		packer->write_new_size = codec_patch_packer_write_new_size;
+		packer->write_entry_header = codec_patch_packer_write_entry_header;
+		packer->write_entry_diff = codec_patch_packer_write_entry_diff;
+		packer->write_entry_extra = codec_patch_packer_write_entry_extra;
+		packer->flush = codec_patch_packer_flush;
+		packer->set_level = codec_patch_packer_set_level;
+		packer->set_threads = codec_patch_packer_set_threads;
+	}
+	return codec_packer->mode;
+}
+/**
+ * @brief create codec_patch_packer
+ * 
+ * @param mode 
+ *   BSDIFF_MODE_READ  0
+ *   BSDIFF_MODE_WRITE 1
+ * @param stream  bsdiff_stream
+ * @param codec the codec written in write mode, read mode detects it
+ * @param levels native levels of the three blocks, NULL for the defaults of codec
+ * @param packer bsdiff_patch_packer
+ * @return int 
+ */
+static int open_codec_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	const struct bsdiff_codec *codec,
+	const int levels[3],
+	struct bsdiff_patch_packer *packer)
+{
+	struct codec_patch_packer *state;
+	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_WRITE);
+	assert(stream);
+	assert(packer);
+
+	state = malloc(sizeof(struct codec_patch_packer));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->stream = stream;
+	state->mode = mode;
+	state->new_size = -1;
+	state->codec = codec;
+	memcpy(state->levels, levels ? levels : codec->presets[8], sizeof(state->levels));
+	state->threads = 1;
+
+	memset(packer, 0, sizeof(*packer));
+	packer->state = state;
+	if (mode == BSDIFF_MODE_READ) {
+		packer->read_new_size      = codec_patch_packer_read_new_size;
+		packer->read_entry_header  = codec_patch_packer_read_entry_header;
+		packer->read_entry_diff    = codec_patch_packer_read_entry_diff;
+		packer->read_entry_extra   = codec_patch_packer_read_entry_extra;
+		packer->map_entry_diff     = codec_patch_packer_map_entry_diff;
+		packer->map_entry_extra    = codec_patch_packer_map_entry_extra;
+	} else {
+		packer->write_new_size     = codec_patch_packer_write_new_size;
+		packer->write_entry_header = codec_patch_packer_write_entry_header;
+		packer->write_entry_diff   = codec_patch_packer_write_entry_diff;
+		packer->write_entry_extra  = codec_patch_packer_write_entry_extra;
+		packer->flush              = codec_patch_packer_flush;
+		packer->set_level          = codec_patch_packer_set_level;
+		packer->set_threads        = codec_patch_packer_set_threads;
+	}
+	packer->close = codec_patch_packer_close;
+	packer->get_mode = codec_patch_packer_getmode;
+	packer->set_mode = codec_patch_packer_setmode;
+	
+	return BSDIFF_SUCCESS;
+}
+
+
+
+int bsdiff_open_bz2_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer)
+{
+	return open_codec_patch_packer(mode, stream, &bz2_codec, NULL, packer);
+}
+
+int bsdiff_open_zstd_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	const int levels[3],
+	struct bsdiff_patch_packer *packer)
+{
+#if defined(BSDIFF_WITH_ZSTD)
+	return open_codec_patch_packer(mode, stream, &zstd_codec, levels, packer);
+#else
+	(void)mode; (void)stream; (void)levels; (void)packer;
+	return BSDIFF_INVALID_ARG;
+#endif
+}
+
+int bsdiff_open_store_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer)
+{
+	return open_codec_patch_packer(mode, stream, &store_codec, NULL, packer);
+}
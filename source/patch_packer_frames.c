@@ -0,0 +1,890 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+/*
+ * Framed patches, see bsdiff_open_frame_patch_packer() for the format.
+ * The writer splits the entries at the frame boundaries: the part of an
+ * entry in a frame gets a triple of its own with a seek of 0, so that every
+ * frame starts with a fresh entry at a known position of the old file.
+ */
+#define FRAME_MAGIC        "BSFRAME1"
+#define FRAME_HEADER_LEN   40
+#define FRAME_INDEX_LEN    40
+#define FRAME_DEFAULT_SIZE (1 << 20)
+
+struct frame_info
+{
+	int64_t old_start;  //position in the old file of the first entry
+	int64_t offset;     //offset of the frame in the patch
+	int64_t len[3];     //lengths of the control, diff and extra blocks
+};
+
+struct frame_patch_packer
+{
+	struct bsdiff_stream *stream;
+	int mode;
+	int is_frame;  //opened by open_frame(), reads one frame of the patch in memory
+
+	const struct bsdiff_codec *codec;
+	int64_t new_size;
+	int64_t frame_size;
+	struct frame_info *frames;
+	int64_t frame_count;
+	int64_t frame_capacity;
+
+	/* read mode */
+	const uint8_t *base;  //the patch, if its stream has get_buffer
+	size_t base_size;
+	int64_t frame;  //the frame being read
+	int64_t frame_left;  //bytes of the new file still to be read in the frame
+	int64_t header_x;
+	int64_t header_y;
+	struct bsdiff_stream blocks[3];
+	struct bsdiff_decompressor dec[3];
+	const uint8_t *map[2];  //the rest of stored diff and extra blocks in memory, or NULL
+	int64_t maplen[2];
+
+	/* write mode */
+	int levels[3];
+	int threads;
+	int in_frame;  //a frame is open
+	struct bsdiff_compressor enc[3];
+	struct bsdiff_stream spill[3];
+	int flush_ret[3];
+	int64_t newpos;  //bytes of the new file written
+	int64_t oldpos;  //position in the old file after the triples written
+	int64_t entry_x;  //diff bytes of the current entry still to be written
+	int64_t entry_y;  //extra bytes of the current entry still to be written
+	int64_t entry_z;
+	int64_t piece_x;  //diff bytes of the current entry in the current frame
+	int64_t piece_y;  //extra bytes of the current entry in the current frame
+	int pending;  //the triple of the current piece is still to be written
+};
+
+static int64_t frame_length(struct frame_patch_packer *packer, int64_t k)
+{
+	int64_t start = k * packer->frame_size;
+	int64_t len = packer->new_size - start;
+	return (len < packer->frame_size) ? len : packer->frame_size;
+}
+/**
+ * @brief close the decompressors and the block streams of the current frame
+ *
+ * @param packer point address of frame_patch_packer
+ */
+static void close_blocks(struct frame_patch_packer *packer)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		bsdiff_close_decompressor(&(packer->dec[i]));
+		bsdiff_close_stream(&(packer->blocks[i]));
+	}
+	packer->map[0] = NULL;
+	packer->map[1] = NULL;
+}
+/**
+ * @brief open the decompressors of the three blocks of frame k
+ *
+ * @param packer point address of frame_patch_packer
+ * @param k the frame
+ * @return int
+ */
+static int open_blocks(struct frame_patch_packer *packer, int64_t k)
+{
+	struct frame_info *info = &(packer->frames[k]);
+	int64_t start = info->offset;
+	int i, ret;
+
+	close_blocks(packer);
+	for (i = 0; i < 3; i++) {
+		if (packer->base != NULL)
+			ret = bsdiff_open_memory_stream(BSDIFF_MODE_READ,
+				packer->base + start, (size_t)info->len[i], &(packer->blocks[i]));
+		else
+			ret = bsdiff_open_substream(packer->stream, start, start + info->len[i], &(packer->blocks[i]));
+		if (ret != BSDIFF_SUCCESS)
+			return BSDIFF_FILE_ERROR;
+		if (packer->codec->create_decompressor(&(packer->dec[i])) != BSDIFF_SUCCESS)
+			return BSDIFF_ERROR;
+		if (packer->dec[i].init(packer->dec[i].state, &(packer->blocks[i])) != BSDIFF_SUCCESS)
+			return BSDIFF_ERROR;
+		/* stored blocks of a patch in memory are used in place */
+		if (i > 0 && packer->codec->stored && packer->base != NULL) {
+			packer->map[i - 1] = packer->base + start;
+			packer->maplen[i - 1] = info->len[i];
+		}
+		start += info->len[i];
+	}
+	packer->frame = k;
+	packer->frame_left = frame_length(packer, k);
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief read the header and the index of the patch, and open the first frame
+ *
+ * @param state point address of frame_patch_packer
+ * @param size store the sizeof(newfile)
+ * @return int
+ */
+static int frame_patch_packer_read_new_size(void *state, int64_t *size)
+{
+	uint8_t header[FRAME_HEADER_LEN];
+	uint8_t *index = NULL;
+	size_t cb;
+	int64_t patch_size, index_offset, end, k;
+	int i, ret;
+	const void *buffer;
+
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	if (packer->new_size >= 0) {
+		*size = packer->new_size;
+		return BSDIFF_SUCCESS;
+	}
+	assert(packer->new_size == -1);
+
+	/* Read header */
+	ret = packer->stream->read(packer->stream->state, header, FRAME_HEADER_LEN, &cb);
+	if (ret != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	if (memcmp(header, FRAME_MAGIC, 8) != 0)
+		return BSDIFF_CORRUPT_PATCH;
+	if ((packer->codec = bsdiff_find_codec(header + 8)) == NULL)
+		return BSDIFF_CORRUPT_PATCH;
+	packer->new_size = bsdiff_offtin(header + 16);
+	packer->frame_size = bsdiff_offtin(header + 24);
+	index_offset = bsdiff_offtin(header + 32);
+	if ((packer->new_size < 0) || (packer->frame_size <= 0) || (index_offset < FRAME_HEADER_LEN)) {
+		packer->new_size = -1;
+		return BSDIFF_CORRUPT_PATCH;
+	}
+	packer->frame_count = packer->new_size / packer->frame_size + (packer->new_size % packer->frame_size != 0);
+
+	/* Read the index */
+	ret = BSDIFF_CORRUPT_PATCH;
+	if ((packer->stream->seek(packer->stream->state, 0, BSDIFF_SEEK_END) != BSDIFF_SUCCESS) ||
+		(packer->stream->tell(packer->stream->state, &patch_size) != BSDIFF_SUCCESS))
+	{
+		ret = BSDIFF_FILE_ERROR;
+		goto cleanup;
+	}
+	if ((index_offset > patch_size) ||
+		(packer->frame_count > (patch_size - index_offset) / FRAME_INDEX_LEN))
+	{
+		goto cleanup;
+	}
+	index = malloc((size_t)packer->frame_count * FRAME_INDEX_LEN + 1);
+	packer->frames = malloc((size_t)packer->frame_count * sizeof(struct frame_info) + 1);
+	if (index == NULL || packer->frames == NULL) {
+		ret = BSDIFF_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	if ((packer->stream->seek(packer->stream->state, index_offset, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS) ||
+		(packer->stream->read(packer->stream->state, index,
+			(size_t)packer->frame_count * FRAME_INDEX_LEN, &cb) != BSDIFF_SUCCESS && packer->frame_count > 0))
+	{
+		ret = BSDIFF_FILE_ERROR;
+		goto cleanup;
+	}
+	for (k = 0; k < packer->frame_count; k++) {
+		packer->frames[k].old_start = bsdiff_offtin(index + k * FRAME_INDEX_LEN);
+		packer->frames[k].offset = bsdiff_offtin(index + k * FRAME_INDEX_LEN + 8);
+		end = packer->frames[k].offset;
+		if (end < FRAME_HEADER_LEN)
+			goto cleanup;
+		for (i = 0; i < 3; i++) {
+			packer->frames[k].len[i] = bsdiff_offtin(index + k * FRAME_INDEX_LEN + 16 + 8 * i);
+			if (packer->frames[k].len[i] < 0 || packer->frames[k].len[i] > index_offset - end)
+				goto cleanup;
+			end += packer->frames[k].len[i];
+		}
+	}
+
+	/* Frames are read in place from a patch in memory */
+	if (packer->stream->get_buffer != NULL &&
+		packer->stream->get_buffer(packer->stream->state, &buffer, &(packer->base_size)) == BSDIFF_SUCCESS &&
+		(int64_t)packer->base_size == patch_size)
+	{
+		packer->base = (const uint8_t*)buffer;
+	}
+
+	if (packer->frame_count > 0 && (ret = open_blocks(packer, 0)) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	*size = packer->new_size;
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	free(index);
+	if (ret != BSDIFF_SUCCESS)
+		packer->new_size = -1;
+	return ret;
+}
+/**
+ * @brief read the next triple, moving to the next frame at the end of one
+ *
+ * @param state point address of frame_patch_packer
+ * @param diff receives the length of the diff string of the entry
+ * @param extra receives the length of the extra string of the entry
+ * @param seek receives the seek in the old file after the entry
+ * @return int
+ *  BSDIFF_CORRUPT_PATCH if the entry overruns the range of its frame
+ */
+static int frame_patch_packer_read_entry_header(
+	void *state, int64_t *diff, int64_t *extra, int64_t *seek)
+{
+	int ret;
+	uint8_t buf[24];
+	size_t cb;
+
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+	assert(packer->header_x == 0 && packer->header_y == 0);
+
+	if (packer->frame_left == 0 && packer->frame + 1 < packer->frame_count) {
+		if ((ret = open_blocks(packer, packer->frame + 1)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	if (packer->frame_count == 0)
+		return BSDIFF_END_OF_FILE;
+
+	ret = packer->dec[0].read(packer->dec[0].state, buf, 24, &cb);
+	if ((ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE) || (cb != 24))
+		return BSDIFF_ERROR;
+	*diff  = bsdiff_offtin(buf);
+	*extra = bsdiff_offtin(buf + 8);
+	*seek  = bsdiff_offtin(buf + 16);
+
+	/* the entries of a frame rebuild exactly its range */
+	if ((*diff < 0) || (*extra < 0) || (*diff > packer->frame_left) ||
+		(*extra > packer->frame_left - *diff))
+	{
+		return BSDIFF_CORRUPT_PATCH;
+	}
+	packer->frame_left -= *diff + *extra;
+	packer->header_x = *diff;
+	packer->header_y = *extra;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief read up to size bytes of the diff (i = 1) or extra (i = 2) of the
+ *   current entry, whose rest is *left
+ *
+ * @param packer point address of frame_patch_packer
+ * @param i the block
+ * @param left packer->header_x or packer->header_y
+ * @param buffer
+ * @param size
+ * @param readed
+ * @return int
+ */
+static int read_entry_block(struct frame_patch_packer *packer, int i, int64_t *left,
+	void *buffer, size_t size, size_t *readed)
+{
+	int ret;
+	int64_t cb;
+
+	*readed = 0;
+
+	cb = (int64_t)size;
+	if (*left < cb)
+		cb = *left;
+	if (cb <= 0)
+		return BSDIFF_END_OF_FILE;
+
+	if (packer->map[i - 1] != NULL) {
+		if (cb > packer->maplen[i - 1])
+			return BSDIFF_CORRUPT_PATCH;
+		memcpy(buffer, packer->map[i - 1], (size_t)cb);
+		packer->map[i - 1] += cb;
+		packer->maplen[i - 1] -= cb;
+		*left -= cb;
+		*readed = (size_t)cb;
+		return BSDIFF_SUCCESS;
+	}
+
+	ret = packer->dec[i].read(packer->dec[i].state, buffer, (size_t)cb, readed);
+	*left -= (int64_t)(*readed);
+	return ret;
+}
+
+static int frame_patch_packer_read_entry_diff(
+	void *state, void *buffer, size_t size, size_t *readed)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	return read_entry_block(packer, 1, &(packer->header_x), buffer, size, readed);
+}
+
+static int frame_patch_packer_read_entry_extra(
+	void *state, void *buffer, size_t size, size_t *readed)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	return read_entry_block(packer, 2, &(packer->header_y), buffer, size, readed);
+}
+/**
+ * @brief return a pointer to the next size bytes of the diff (i = 1) or
+ *   extra (i = 2) of the current entry, if the block is stored in memory
+ */
+static int map_entry_block(struct frame_patch_packer *packer, int i, int64_t *left,
+	size_t size, const void **buffer)
+{
+	if (packer->map[i - 1] == NULL)
+		return BSDIFF_ERROR;
+	if ((int64_t)size > *left || (int64_t)size > packer->maplen[i - 1])
+		return BSDIFF_CORRUPT_PATCH;
+	*buffer = packer->map[i - 1];
+	packer->map[i - 1] += size;
+	packer->maplen[i - 1] -= (int64_t)size;
+	*left -= (int64_t)size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int frame_patch_packer_map_entry_diff(
+	void *state, size_t size, const void **buffer)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	return map_entry_block(packer, 1, &(packer->header_x), size, buffer);
+}
+
+static int frame_patch_packer_map_entry_extra(
+	void *state, size_t size, const void **buffer)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	return map_entry_block(packer, 2, &(packer->header_y), size, buffer);
+}
+
+static int frame_patch_packer_read_frame_count(void *state, int64_t *count)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	*count = packer->frame_count;
+	return BSDIFF_SUCCESS;
+}
+
+static void frame_patch_packer_close(void *state);
+static int frame_patch_packer_getmode(void *state);
+/**
+ * @brief open a packer reading frame `index` alone, from the patch in memory
+ *
+ * @param state point address of frame_patch_packer
+ * @param index the frame
+ * @param frame the packer to be opened, NULL to get the range only
+ * @param new_start start of the range of the new file rebuilt by the frame
+ * @param new_end end of the range
+ * @param old_start position in the old file of the first entry
+ * @return int
+ */
+static int frame_patch_packer_open_frame(
+	void *state, int64_t index, struct bsdiff_patch_packer *frame,
+	int64_t *new_start, int64_t *new_end, int64_t *old_start)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	struct frame_patch_packer *sub;
+	int ret;
+	assert(packer->mode == BSDIFF_MODE_READ);
+	assert(packer->new_size >= 0);
+
+	if (index < 0 || index >= packer->frame_count)
+		return BSDIFF_INVALID_ARG;
+	*new_start = index * packer->frame_size;
+	*new_end = *new_start + frame_length(packer, index);
+	*old_start = packer->frames[index].old_start;
+	if (frame == NULL)
+		return BSDIFF_SUCCESS;
+	if (packer->base == NULL)
+		return BSDIFF_INVALID_ARG;
+
+	sub = malloc(sizeof(struct frame_patch_packer));
+	if (!sub)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(sub, 0, sizeof(*sub));
+	sub->mode = BSDIFF_MODE_READ;
+	sub->is_frame = 1;
+	sub->codec = packer->codec;
+	sub->new_size = *new_end - *new_start;
+	sub->frame_size = packer->frame_size;
+	sub->frame_count = 1;
+	sub->base = packer->base;
+	sub->base_size = packer->base_size;
+	sub->frames = malloc(sizeof(struct frame_info));
+	if (sub->frames == NULL) {
+		free(sub);
+		return BSDIFF_OUT_OF_MEMORY;
+	}
+	sub->frames[0] = packer->frames[index];
+
+	memset(frame, 0, sizeof(*frame));
+	frame->state = sub;
+	frame->close = frame_patch_packer_close;
+	frame->get_mode = frame_patch_packer_getmode;
+	frame->read_new_size      = frame_patch_packer_read_new_size;
+	frame->read_entry_header  = frame_patch_packer_read_entry_header;
+	frame->read_entry_diff    = frame_patch_packer_read_entry_diff;
+	frame->read_entry_extra   = frame_patch_packer_read_entry_extra;
+	frame->map_entry_diff     = frame_patch_packer_map_entry_diff;
+	frame->map_entry_extra    = frame_patch_packer_map_entry_extra;
+
+	if ((ret = open_blocks(sub, 0)) != BSDIFF_SUCCESS) {
+		bsdiff_close_patch_packer(frame);
+		return ret;
+	}
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief finish the compressor of block i of the current frame, run by
+ *   bsdiff_parallel_for()
+ */
+static void flush_compressor(void *arg, int i)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)arg;
+
+	packer->flush_ret[i] = packer->enc[i].flush(packer->enc[i].state);
+}
+/**
+ * @brief start a frame: record it in the index and open the compressors of
+ *   its blocks, which are compressed into memory. Frames are small, so the
+ *   blocks aren't compressed on worker threads while being written, but
+ *   when the frame ends (most of the work of bzip2 is done at the flush).
+ *
+ * @param packer point address of frame_patch_packer
+ * @return int
+ */
+static int begin_frame(struct frame_patch_packer *packer)
+{
+	struct frame_info *frames;
+	int64_t offset;
+	int i;
+
+	if (packer->frame_count == packer->frame_capacity) {
+		packer->frame_capacity = packer->frame_capacity ? packer->frame_capacity * 2 : 16;
+		frames = realloc(packer->frames, (size_t)packer->frame_capacity * sizeof(struct frame_info));
+		if (frames == NULL)
+			return BSDIFF_OUT_OF_MEMORY;
+		packer->frames = frames;
+	}
+	if (packer->stream->tell(packer->stream->state, &offset) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	memset(&(packer->frames[packer->frame_count]), 0, sizeof(struct frame_info));
+	packer->frames[packer->frame_count].old_start = packer->oldpos;
+	packer->frames[packer->frame_count].offset = offset;
+
+	for (i = 0; i < 3; i++) {
+		if (bsdiff_open_memory_stream(BSDIFF_MODE_WRITE, NULL, 0, &(packer->spill[i])) != BSDIFF_SUCCESS)
+			return BSDIFF_OUT_OF_MEMORY;
+		if (packer->codec->create_compressor(&(packer->enc[i]), packer->levels[i], packer->threads) != BSDIFF_SUCCESS)
+			return BSDIFF_ERROR;
+		if (packer->enc[i].init(packer->enc[i].state, &(packer->spill[i])) != BSDIFF_SUCCESS)
+			return BSDIFF_ERROR;
+	}
+	packer->in_frame = 1;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief finish the current frame: compress the rest of its blocks and
+ *   append them to the patch
+ *
+ * @param packer point address of frame_patch_packer
+ * @return int
+ */
+static int end_frame(struct frame_patch_packer *packer)
+{
+	const void *buffer;
+	size_t size;
+	int i, ret = BSDIFF_SUCCESS;
+
+	bsdiff_parallel_for(3, flush_compressor, packer);
+	for (i = 0; i < 3; i++) {
+		if (ret == BSDIFF_SUCCESS && packer->flush_ret[i] != BSDIFF_SUCCESS)
+			ret = BSDIFF_ERROR;
+		if (ret == BSDIFF_SUCCESS &&
+			((packer->spill[i].get_buffer(packer->spill[i].state, &buffer, &size) != BSDIFF_SUCCESS) ||
+			 (packer->stream->write(packer->stream->state, buffer, size) != BSDIFF_SUCCESS)))
+		{
+			ret = BSDIFF_FILE_ERROR;
+		}
+		packer->frames[packer->frame_count].len[i] = (int64_t)size;
+		bsdiff_close_compressor(&(packer->enc[i]));
+		bsdiff_close_stream(&(packer->spill[i]));
+	}
+	packer->frame_count++;
+	packer->in_frame = 0;
+
+	return ret;
+}
+/**
+ * @brief write the triple of the current piece of the current entry
+ *
+ * @param packer point address of frame_patch_packer
+ * @param seek the seek of the triple, 0 if the entry goes on in the next frame
+ * @return int
+ */
+static int write_piece(struct frame_patch_packer *packer, int64_t seek)
+{
+	uint8_t buf[24];
+
+	bsdiff_offtout(packer->piece_x, buf);
+	bsdiff_offtout(packer->piece_y, buf + 8);
+	bsdiff_offtout(seek, buf + 16);
+	if (packer->enc[0].write(packer->enc[0].state, buf, 24) != BSDIFF_SUCCESS)
+		return BSDIFF_ERROR;
+	packer->oldpos += packer->piece_x + seek;
+	packer->piece_x = 0;
+	packer->piece_y = 0;
+	packer->pending = 0;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief write the pseudo header
+ *
+ * @param state point address of frame_patch_packer
+ * @param size new file size
+ * @return int
+ */
+static int frame_patch_packer_write_new_size(
+	void *state, int64_t size)
+{
+	uint8_t header[FRAME_HEADER_LEN] = { 0 };
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size == -1);
+	assert(size >= 0);
+
+	if (packer->stream->write(packer->stream->state, header, FRAME_HEADER_LEN) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	packer->new_size = size;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int frame_patch_packer_write_entry_header(
+	void *state, int64_t diff, int64_t extra, int64_t seek)
+{
+	int ret;
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(diff >= 0);
+	assert(extra >= 0);
+	assert(packer->entry_x == 0 && packer->entry_y == 0);
+
+	/* The previous entry is complete */
+	if (packer->pending && (ret = write_piece(packer, packer->entry_z)) != BSDIFF_SUCCESS)
+		return ret;
+	if (packer->in_frame && packer->newpos == (packer->frame_count + 1) * packer->frame_size) {
+		if ((ret = end_frame(packer)) != BSDIFF_SUCCESS)
+			return ret;
+	}
+	/* Entries past the end of the new file are never read */
+	if (packer->newpos == packer->new_size)
+		return (diff == 0 && extra == 0) ? BSDIFF_SUCCESS : BSDIFF_INVALID_ARG;
+	if (!packer->in_frame && (ret = begin_frame(packer)) != BSDIFF_SUCCESS)
+		return ret;
+
+	packer->entry_x = diff;
+	packer->entry_y = extra;
+	packer->entry_z = seek;
+	packer->pending = 1;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief write the diff (i = 1) or extra (i = 2) bytes of the current entry,
+ *   splitting it at the frame boundaries
+ *
+ * @param packer point address of frame_patch_packer
+ * @param i the block
+ * @param buffer
+ * @param size
+ * @return int
+ */
+static int write_entry_block(struct frame_patch_packer *packer, int i,
+	const void *buffer, size_t size)
+{
+	const uint8_t *p = (const uint8_t*)buffer;
+	int64_t *left = (i == 1) ? &(packer->entry_x) : &(packer->entry_y);
+	int64_t *piece = (i == 1) ? &(packer->piece_x) : &(packer->piece_y);
+	int64_t n;
+	int ret;
+
+	if ((int64_t)size > *left || packer->newpos + (int64_t)size > packer->new_size)
+		return BSDIFF_INVALID_ARG;
+
+	while (size > 0) {
+		n = (packer->frame_count + 1) * packer->frame_size - packer->newpos;
+		if (n == 0) {
+			/* the frame is full, the entry goes on in the next one */
+			if (((ret = write_piece(packer, 0)) != BSDIFF_SUCCESS) ||
+				((ret = end_frame(packer)) != BSDIFF_SUCCESS) ||
+				((ret = begin_frame(packer)) != BSDIFF_SUCCESS))
+			{
+				return ret;
+			}
+			packer->pending = 1;
+			continue;
+		}
+		if (n > (int64_t)size)
+			n = (int64_t)size;
+		if (packer->enc[i].write(packer->enc[i].state, p, (size_t)n) != BSDIFF_SUCCESS)
+			return BSDIFF_ERROR;
+		p += n;
+		size -= (size_t)n;
+		*left -= n;
+		*piece += n;
+		packer->newpos += n;
+	}
+
+	return BSDIFF_SUCCESS;
+}
+
+static int frame_patch_packer_write_entry_diff(
+	void *state, const void *buffer, size_t size)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	return write_entry_block(packer, 1, buffer, size);
+}
+
+static int frame_patch_packer_write_entry_extra(
+	void *state, const void *buffer, size_t size)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+
+	/* the diff bytes of the entry come first */
+	if (packer->entry_x != 0)
+		return BSDIFF_INVALID_ARG;
+	return write_entry_block(packer, 2, buffer, size);
+}
+
+static int frame_patch_packer_set_level(void *state, int level)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+
+	if (packer->new_size != -1)
+		return BSDIFF_ERROR;
+	if (level < 1 || level > 9)
+		return BSDIFF_INVALID_ARG;
+	memcpy(packer->levels, packer->codec->presets[level - 1], sizeof(packer->levels));
+
+	return BSDIFF_SUCCESS;
+}
+
+static int frame_patch_packer_set_threads(void *state, int threads)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+
+	if (packer->new_size != -1)
+		return BSDIFF_ERROR;
+	if (threads < 1)
+		return BSDIFF_INVALID_ARG;
+	packer->threads = threads;
+
+	return BSDIFF_SUCCESS;
+}
+/**
+ * @brief finish the last frame, write the index and rewrite the header
+ *
+ * @param state point address of frame_patch_packer
+ * @return int
+ */
+static int frame_patch_packer_flush(void *state)
+{
+	uint8_t header[FRAME_HEADER_LEN] = { 0 };
+	uint8_t buf[FRAME_INDEX_LEN];
+	int64_t index_offset, k;
+	int i, ret;
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	assert(packer->mode == BSDIFF_MODE_WRITE);
+	assert(packer->new_size >= 0);
+	assert(packer->entry_x == 0 && packer->entry_y == 0);
+
+	if (packer->pending && (ret = write_piece(packer, packer->entry_z)) != BSDIFF_SUCCESS)
+		return ret;
+	if (packer->in_frame && (ret = end_frame(packer)) != BSDIFF_SUCCESS)
+		return ret;
+	if (packer->newpos != packer->new_size)
+		return BSDIFF_INVALID_ARG;
+
+	/* Write the index */
+	if (packer->stream->tell(packer->stream->state, &index_offset) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+	for (k = 0; k < packer->frame_count; k++) {
+		bsdiff_offtout(packer->frames[k].old_start, buf);
+		bsdiff_offtout(packer->frames[k].offset, buf + 8);
+		for (i = 0; i < 3; i++)
+			bsdiff_offtout(packer->frames[k].len[i], buf + 16 + 8 * i);
+		if (packer->stream->write(packer->stream->state, buf, FRAME_INDEX_LEN) != BSDIFF_SUCCESS)
+			return BSDIFF_FILE_ERROR;
+	}
+
+	/* Seek to the beginning, (re)write the header */
+	memcpy(header, FRAME_MAGIC, 8);
+	memcpy(header + 8, packer->codec->magic, 8);
+	bsdiff_offtout(packer->new_size, header + 16);
+	bsdiff_offtout(packer->frame_size, header + 24);
+	bsdiff_offtout(index_offset, header + 32);
+	if ((packer->stream->seek(packer->stream->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS) ||
+		(packer->stream->write(packer->stream->state, header, FRAME_HEADER_LEN) != BSDIFF_SUCCESS) ||
+		(packer->stream->flush(packer->stream->state) != BSDIFF_SUCCESS))
+	{
+		return BSDIFF_FILE_ERROR;
+	}
+	return BSDIFF_SUCCESS;
+}
+
+static void frame_patch_packer_close(void *state)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	int i;
+
+	if (packer->mode == BSDIFF_MODE_READ) {
+		close_blocks(packer);
+	} else {
+		for (i = 0; i < 3; i++) {
+			bsdiff_close_compressor(&(packer->enc[i]));
+			bsdiff_close_stream(&(packer->spill[i]));
+		}
+	}
+	free(packer->frames);
+
+	/* a frame doesn't own the stream of the patch */
+	if (!packer->is_frame)
+		bsdiff_close_stream(packer->stream);
+
+	free(packer);
+}
+
+static int frame_patch_packer_getmode(void *state)
+{
+	struct frame_patch_packer *packer = (struct frame_patch_packer*)state;
+	return packer->mode;
+}
+
+static void set_functions(struct bsdiff_patch_packer *packer, int mode)
+{
+	if (mode == BSDIFF_MODE_READ) {
+		packer->read_new_size      = frame_patch_packer_read_new_size;
+		packer->read_entry_header  = frame_patch_packer_read_entry_header;
+		packer->read_entry_diff    = frame_patch_packer_read_entry_diff;
+		packer->read_entry_extra   = frame_patch_packer_read_entry_extra;
+		packer->map_entry_diff     = frame_patch_packer_map_entry_diff;
+		packer->map_entry_extra    = frame_patch_packer_map_entry_extra;
+		packer->read_frame_count   = frame_patch_packer_read_frame_count;
+		packer->open_frame         = frame_patch_packer_open_frame;
+	} else {
+		packer->write_new_size     = frame_patch_packer_write_new_size;
+		packer->write_entry_header = frame_patch_packer_write_entry_header;
+		packer->write_entry_diff   = frame_patch_packer_write_entry_diff;
+		packer->write_entry_extra  = frame_patch_packer_write_entry_extra;
+		packer->flush              = frame_patch_packer_flush;
+		packer->set_level          = frame_patch_packer_set_level;
+		packer->set_threads        = frame_patch_packer_set_threads;
+	}
+}
+/**
+ * @brief set the mode of bsdiff_patch_packer, and reset the operation functions piont address
+ *
+ * @param bsdiff_packer point address of bsdiff_patch_packer
+ * @param mode
+ * @return int frame_packer->mode
+ */
+static int frame_patch_packer_setmode(void* bsdiff_packer, int mode)
+{
+	struct bsdiff_patch_packer* packer = (struct bsdiff_patch_packer*)bsdiff_packer;
+	struct frame_patch_packer* frame_packer = (struct frame_patch_packer*)packer->state;
+	struct bsdiff_stream* bstream = (struct bsdiff_stream*)frame_packer->stream;
+	frame_packer->mode = mode;
+	bstream->set_mode(bstream, mode);
+	set_functions(packer, mode);
+	return frame_packer->mode;
+}
+
+int bsdiff_open_frame_patch_packer(
+	int mode,
+	struct bsdiff_stream *stream,
+	int codec,
+	int64_t frame_size,
+	struct bsdiff_patch_packer *packer)
+{
+	struct frame_patch_packer *state;
+	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_WRITE);
+	assert(stream);
+	assert(packer);
+
+	if (frame_size < 0)
+		return BSDIFF_INVALID_ARG;
+	if (mode == BSDIFF_MODE_WRITE && bsdiff_get_codec(codec) == NULL)
+		return BSDIFF_INVALID_ARG;
+
+	state = malloc(sizeof(struct frame_patch_packer));
+	if (!state)
+		return BSDIFF_OUT_OF_MEMORY;
+	memset(state, 0, sizeof(*state));
+	state->stream = stream;
+	state->mode = mode;
+	state->new_size = -1;
+	if (mode == BSDIFF_MODE_WRITE) {
+		state->codec = bsdiff_get_codec(codec);
+		state->frame_size = frame_size ? frame_size : FRAME_DEFAULT_SIZE;
+		memcpy(state->levels, state->codec->presets[8], sizeof(state->levels));
+		state->threads = 1;
+	}
+
+	memset(packer, 0, sizeof(*packer));
+	packer->state = state;
+	set_functions(packer, mode);
+	packer->close = frame_patch_packer_close;
+	packer->get_mode = frame_patch_packer_getmode;
+	packer->set_mode = frame_patch_packer_setmode;
+
+	return BSDIFF_SUCCESS;
+}
+
+int bsdiff_open_patch_reader(
+	struct bsdiff_stream *stream,
+	struct bsdiff_patch_packer *packer)
+{
+	uint8_t magic[8];
+	size_t cb;
+	int ret;
+
+	ret = stream->read(stream->state, magic, sizeof(magic), &cb);
+	if (ret != BSDIFF_SUCCESS && ret != BSDIFF_END_OF_FILE)
+		return BSDIFF_FILE_ERROR;
+	if (stream->seek(stream->state, 0, BSDIFF_SEEK_SET) != BSDIFF_SUCCESS)
+		return BSDIFF_FILE_ERROR;
+
+	if (cb == sizeof(magic) && memcmp(magic, FRAME_MAGIC, 8) == 0)
+		return bsdiff_open_frame_patch_packer(BSDIFF_MODE_READ, stream, BSDIFF_CODEC_BZ2, 0, packer);
+	return bsdiff_open_bz2_patch_packer(BSDIFF_MODE_READ, stream, packer);
+}
@@ -0,0 +1,209 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+/*
+ * On-disk cache of the suffix array of an old file, named after the
+ * content hash and size of the file:
+ *
+ *	<dir>/<hash>-<size>.sa
+ *
+ * The file is the header below followed by the suffix array as bsdiff()
+ * keeps it in memory (oldsize+1 entries of `width` bytes, native byte
+ * order), so that it can be used in place from a read only mapping.
+ */
+#define SA_CACHE_MAGIC   "BSDIFFSA"
+#define SA_CACHE_VERSION 1
+#define SA_CACHE_BOM     0x0102
+
+struct sa_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint16_t width;
+	uint16_t bom;        /* detects a cache written on another byte order */
+	int64_t oldsize;
+	uint64_t key;        /* content hash of the old file */
+	uint64_t checksum;   /* hash of the suffix array */
+	uint64_t reserved;
+};
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t v)
+{
+	acc += v * PRIME2;
+	return rotl64(acc, 31) * PRIME1;
+}
+
+/* A 4-lane multiply-rotate hash in the style of xxHash64. It is only used
+   to name and check cache files, not for security. */
+uint64_t bsdiff_hash(const uint8_t *buf, int64_t size)
+{
+	uint64_t v1 = PRIME1 + PRIME2, v2 = PRIME2, v3 = 0, v4 = 0 - PRIME1;
+	uint64_t h;
+	int64_t i = 0;
+
+	for (; i + 32 <= size; i += 32) {
+		v1 = hash_round(v1, read64(buf + i));
+		v2 = hash_round(v2, read64(buf + i + 8));
+		v3 = hash_round(v3, read64(buf + i + 16));
+		v4 = hash_round(v4, read64(buf + i + 24));
+	}
+	h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+	h += (uint64_t)size;
+	for (; i + 8 <= size; i += 8)
+		h = rotl64(h ^ hash_round(0, read64(buf + i)), 27) * PRIME1 + PRIME3;
+	for (; i < size; i++)
+		h = rotl64(h ^ (buf[i] * PRIME3), 11) * PRIME1;
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+static char *cache_path(const char *dir, uint64_t key, int64_t oldsize, const char *suffix)
+{
+	size_t len = strlen(dir) + 64;
+	char *path = malloc(len);
+	if (path != NULL) {
+		snprintf(path, len, "%s/%016llx-%llx.sa%s", dir,
+			(unsigned long long)key, (unsigned long long)oldsize, suffix);
+	}
+	return path;
+}
+
+int bsdiff_sa_cache_load(
+	const char *dir,
+	uint64_t key,
+	int64_t oldsize,
+	int width,
+	struct bsdiff_stream *mapping,
+	const uint8_t **SA)
+{
+	int ret = BSDIFF_FILE_ERROR;
+	char *path;
+	const void *buffer;
+	size_t size;
+	struct sa_cache_header header;
+	const uint8_t *payload;
+	uint64_t payload_size = (uint64_t)(oldsize + 1) * (uint64_t)width;
+
+	if ((path = cache_path(dir, key, oldsize, "")) == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+	if (bsdiff_open_mmap_stream(path, mapping) != BSDIFF_SUCCESS)
+		goto cleanup;
+	if (mapping->get_buffer(mapping->state, &buffer, &size) != BSDIFF_SUCCESS)
+		goto cleanup;
+
+	/* Validate the header, then the suffix array itself */
+	ret = BSDIFF_CORRUPT_PATCH;
+	if (size < sizeof(header) || (uint64_t)(size - sizeof(header)) != payload_size)
+		goto cleanup;
+	memcpy(&header, buffer, sizeof(header));
+	payload = (const uint8_t*)buffer + sizeof(header);
+	if ((memcmp(header.magic, SA_CACHE_MAGIC, sizeof(header.magic)) != 0) ||
+		(header.version != SA_CACHE_VERSION) ||
+		(header.width != width) ||
+		(header.bom != SA_CACHE_BOM) ||
+		(header.oldsize != oldsize) ||
+		(header.key != key) ||
+		(header.checksum != bsdiff_hash(payload, (int64_t)payload_size)))
+	{
+		goto cleanup;
+	}
+
+	*SA = payload;
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	if (ret != BSDIFF_SUCCESS)
+		bsdiff_close_stream(mapping);
+	free(path);
+	return ret;
+}
+
+int bsdiff_sa_cache_store(
+	const char *dir,
+	uint64_t key,
+	int64_t oldsize,
+	int width,
+	const uint8_t *SA)
+{
+	int ret = BSDIFF_FILE_ERROR;
+	char *path = NULL, *tmppath = NULL;
+	char suffix[32];
+	struct bsdiff_stream file = { 0 };
+	struct sa_cache_header header;
+	uint64_t payload_size = (uint64_t)(oldsize + 1) * (uint64_t)width;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SA_CACHE_MAGIC, sizeof(header.magic));
+	header.version = SA_CACHE_VERSION;
+	header.width = (uint16_t)width;
+	header.bom = SA_CACHE_BOM;
+	header.oldsize = oldsize;
+	header.key = key;
+	header.checksum = bsdiff_hash(SA, (int64_t)payload_size);
+
+	/* Write a temporary file and rename it, so that a concurrent bsdiff
+	   never maps a partially written cache */
+	snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+	path = cache_path(dir, key, oldsize, "");
+	tmppath = cache_path(dir, key, oldsize, suffix);
+	if (path == NULL || tmppath == NULL) {
+		ret = BSDIFF_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	if (bsdiff_open_file_stream(BSDIFF_MODE_WRITE, tmppath, &file) != BSDIFF_SUCCESS)
+		goto cleanup;
+	if ((file.write(file.state, &header, sizeof(header)) != BSDIFF_SUCCESS) ||
+		(file.write(file.state, SA, (size_t)payload_size) != BSDIFF_SUCCESS) ||
+		(file.flush(file.state) != BSDIFF_SUCCESS))
+	{
+		bsdiff_close_stream(&file);
+		remove(tmppath);
+		goto cleanup;
+	}
+	bsdiff_close_stream(&file);
+
+#if defined(_WIN32)
+	/* rename() doesn't replace an existing (stale) cache on Windows */
+	remove(path);
+#endif
+	if (rename(tmppath, path) != 0) {
+		remove(tmppath);
+		goto cleanup;
+	}
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	free(tmppath);
+	free(path);
+	return ret;
+}
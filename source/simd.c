@@ -0,0 +1,528 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__)
+#define TARGET(x) __attribute__((target(x)))
+#else
+#define TARGET(x)
+#endif
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define SIMD_LITTLE_ENDIAN 1
+#elif defined(_MSC_VER) || defined(SIMD_X86)
+#define SIMD_LITTLE_ENDIAN 1
+#endif
+
+/* index of the lowest set bit, x != 0 */
+static inline int ctz64(uint64_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long i;
+	_BitScanForward64(&i, x);
+	return (int)i;
+#else
+	int i = 0;
+	while ((x & 1) == 0) { x >>= 1; i++; }
+	return i;
+#endif
+}
+
+/* number of set bits */
+static inline int popcount64(uint64_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/* matchlen: length of the common prefix of a and b, at most n bytes */
+
+static int64_t matchlen_scalar(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+#if defined(SIMD_LITTLE_ENDIAN)
+	uint64_t x, y;
+
+	/* 8 bytes at a time, the first mismatch is the lowest non-zero byte of x^y */
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		if (x != y)
+			return i + (ctz64(x ^ y) >> 3);
+	}
+#endif
+	for (; i < n; i++) {
+		if (a[i] != b[i])
+			break;
+	}
+	return i;
+}
+
+/* sub: dst[i] = a[i] - b[i] for i in [0, n), the diff bytes of bsdiff */
+
+static void sub_scalar(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = (uint8_t)(a[i] - b[i]);
+}
+
+/* add: dst[i] = a[i] + b[i] for i in [0, n), the new bytes of bspatch */
+
+static void add_scalar(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = (uint8_t)(a[i] + b[i]);
+}
+
+/* eqcount: number of i in [0, n) with a[i] == b[i] */
+
+static int64_t eqcount_scalar(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i, count = 0;
+
+	for (i = 0; i < n; i++)
+		count += (a[i] == b[i]);
+	return count;
+}
+
+#if defined(SIMD_X86)
+
+TARGET("sse2")
+static int64_t matchlen_sse2(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+	unsigned int mask;
+	__m128i va, vb;
+
+	for (; i + 16 <= n; i += 16) {
+		va = _mm_loadu_si128((const __m128i*)(a + i));
+		vb = _mm_loadu_si128((const __m128i*)(b + i));
+		mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xFFFFu;
+		if (mask != 0)
+			return i + ctz64(mask);
+	}
+	return i + matchlen_scalar(a + i, b + i, n - i);
+}
+
+TARGET("avx2")
+static int64_t matchlen_avx2(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+	uint32_t mask;
+	__m256i va, vb;
+
+	for (; i + 32 <= n; i += 32) {
+		va = _mm256_loadu_si256((const __m256i*)(a + i));
+		vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (mask != 0)
+			return i + ctz64(mask);
+	}
+	return i + matchlen_sse2(a + i, b + i, n - i);
+}
+
+TARGET("avx512f,avx512bw")
+static int64_t matchlen_avx512(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+	uint64_t mask;
+	__m512i va, vb;
+
+	for (; i + 64 <= n; i += 64) {
+		va = _mm512_loadu_si512((const void*)(a + i));
+		vb = _mm512_loadu_si512((const void*)(b + i));
+		mask = _mm512_cmpneq_epi8_mask(va, vb);
+		if (mask != 0)
+			return i + ctz64(mask);
+	}
+	return i + matchlen_avx2(a + i, b + i, n - i);
+}
+
+TARGET("sse2")
+static void sub_sse2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+	__m128i va, vb;
+
+	for (; i + 16 <= n; i += 16) {
+		va = _mm_loadu_si128((const __m128i*)(a + i));
+		vb = _mm_loadu_si128((const __m128i*)(b + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_sub_epi8(va, vb));
+	}
+	sub_scalar(dst + i, a + i, b + i, n - i);
+}
+
+TARGET("avx2")
+static void sub_avx2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+	__m256i va, vb;
+
+	for (; i + 32 <= n; i += 32) {
+		va = _mm256_loadu_si256((const __m256i*)(a + i));
+		vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_sub_epi8(va, vb));
+	}
+	sub_sse2(dst + i, a + i, b + i, n - i);
+}
+
+TARGET("avx512f,avx512bw")
+static void sub_avx512(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+	__m512i va, vb;
+	__mmask64 mask;
+
+	for (; i + 64 <= n; i += 64) {
+		va = _mm512_loadu_si512((const void*)(a + i));
+		vb = _mm512_loadu_si512((const void*)(b + i));
+		_mm512_storeu_si512((void*)(dst + i), _mm512_sub_epi8(va, vb));
+	}
+	/* the tail with masked loads and stores */
+	if (i < n) {
+		mask = ~(uint64_t)0 >> (64 - (n - i));
+		va = _mm512_maskz_loadu_epi8(mask, (const void*)(a + i));
+		vb = _mm512_maskz_loadu_epi8(mask, (const void*)(b + i));
+		_mm512_mask_storeu_epi8((void*)(dst + i), mask, _mm512_sub_epi8(va, vb));
+	}
+}
+
+TARGET("sse2")
+static void add_sse2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+	__m128i va, vb;
+
+	for (; i + 16 <= n; i += 16) {
+		va = _mm_loadu_si128((const __m128i*)(a + i));
+		vb = _mm_loadu_si128((const __m128i*)(b + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(va, vb));
+	}
+	add_scalar(dst + i, a + i, b + i, n - i);
+}
+
+TARGET("avx2")
+static void add_avx2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+	__m256i va, vb;
+
+	for (; i + 32 <= n; i += 32) {
+		va = _mm256_loadu_si256((const __m256i*)(a + i));
+		vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_add_epi8(va, vb));
+	}
+	add_sse2(dst + i, a + i, b + i, n - i);
+}
+
+TARGET("avx512f,avx512bw")
+static void add_avx512(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+	__m512i va, vb;
+	__mmask64 mask;
+
+	for (; i + 64 <= n; i += 64) {
+		va = _mm512_loadu_si512((const void*)(a + i));
+		vb = _mm512_loadu_si512((const void*)(b + i));
+		_mm512_storeu_si512((void*)(dst + i), _mm512_add_epi8(va, vb));
+	}
+	if (i < n) {
+		mask = ~(uint64_t)0 >> (64 - (n - i));
+		va = _mm512_maskz_loadu_epi8(mask, (const void*)(a + i));
+		vb = _mm512_maskz_loadu_epi8(mask, (const void*)(b + i));
+		_mm512_mask_storeu_epi8((void*)(dst + i), mask, _mm512_add_epi8(va, vb));
+	}
+}
+
+TARGET("sse2")
+static int64_t eqcount_sse2(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0, count = 0;
+	int k;
+	__m128i acc, eq;
+
+	while (i + 16 <= n) {
+		/* count in bytes (-1 per match) for at most 255 rounds, then sum */
+		acc = _mm_setzero_si128();
+		for (k = 0; k < 255 && i + 16 <= n; k++, i += 16) {
+			eq = _mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i*)(a + i)),
+				_mm_loadu_si128((const __m128i*)(b + i)));
+			acc = _mm_sub_epi8(acc, eq);
+		}
+		acc = _mm_sad_epu8(acc, _mm_setzero_si128());
+		count += _mm_cvtsi128_si32(acc) + _mm_extract_epi16(acc, 4);
+	}
+	return count + eqcount_scalar(a + i, b + i, n - i);
+}
+
+TARGET("avx2")
+static int64_t eqcount_avx2(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0, count = 0;
+	int k;
+	__m256i acc, eq;
+	__m128i sum;
+
+	while (i + 32 <= n) {
+		acc = _mm256_setzero_si256();
+		for (k = 0; k < 255 && i + 32 <= n; k++, i += 32) {
+			eq = _mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i*)(a + i)),
+				_mm256_loadu_si256((const __m256i*)(b + i)));
+			acc = _mm256_sub_epi8(acc, eq);
+		}
+		acc = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+		sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		count += _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
+	}
+	return count + eqcount_sse2(a + i, b + i, n - i);
+}
+
+TARGET("avx512f,avx512bw,popcnt")
+static int64_t eqcount_avx512(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0, count = 0;
+	__mmask64 mask;
+
+	for (; i + 64 <= n; i += 64) {
+		mask = _mm512_cmpeq_epi8_mask(
+			_mm512_loadu_si512((const void*)(a + i)),
+			_mm512_loadu_si512((const void*)(b + i)));
+		count += popcount64(mask);
+	}
+	if (i < n) {
+		mask = ~(uint64_t)0 >> (64 - (n - i));
+		mask = _mm512_mask_cmpeq_epi8_mask(mask,
+			_mm512_maskz_loadu_epi8(mask, (const void*)(a + i)),
+			_mm512_maskz_loadu_epi8(mask, (const void*)(b + i)));
+		count += popcount64(mask);
+	}
+	return count;
+}
+
+#endif /* SIMD_X86 */
+
+#if defined(SIMD_NEON)
+
+static int64_t matchlen_neon(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+	uint64_t mask;
+	uint8x16_t eq;
+
+	for (; i + 16 <= n; i += 16) {
+		eq = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+		/* narrow to 4 bits per byte */
+		mask = ~vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+		if (mask != 0)
+			return i + (ctz64(mask) >> 2);
+	}
+	return i + matchlen_scalar(a + i, b + i, n - i);
+}
+
+static void sub_neon(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+
+	for (; i + 16 <= n; i += 16)
+		vst1q_u8(dst + i, vsubq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+	sub_scalar(dst + i, a + i, b + i, n - i);
+}
+
+static void add_neon(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0;
+
+	for (; i + 16 <= n; i += 16)
+		vst1q_u8(dst + i, vaddq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+	add_scalar(dst + i, a + i, b + i, n - i);
+}
+
+static int64_t eqcount_neon(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	int64_t i = 0, count = 0;
+
+	for (; i + 16 <= n; i += 16)
+		count += vaddvq_u8(vshrq_n_u8(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i)), 7));
+	return count + eqcount_scalar(a + i, b + i, n - i);
+}
+
+#endif /* SIMD_NEON */
+
+/* runtime dispatch */
+
+#define SIMD_SCALAR  0
+#define SIMD_SSE2    1
+#define SIMD_AVX2    2
+#define SIMD_AVX512  3
+#define SIMD_NEON_   4
+
+static const struct bsdiff_simd_impl simd_impls[] = {
+	{ "scalar", matchlen_scalar, sub_scalar, eqcount_scalar, add_scalar },
+#if defined(SIMD_X86)
+	{ "sse2", matchlen_sse2, sub_sse2, eqcount_sse2, add_sse2 },
+	{ "avx2", matchlen_avx2, sub_avx2, eqcount_avx2, add_avx2 },
+	{ "avx512", matchlen_avx512, sub_avx512, eqcount_avx512, add_avx512 },
+#else
+	{ NULL, NULL, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL },
+	{ NULL, NULL, NULL, NULL, NULL },
+#endif
+#if defined(SIMD_NEON)
+	{ "neon", matchlen_neon, sub_neon, eqcount_neon, add_neon },
+#else
+	{ NULL, NULL, NULL, NULL, NULL },
+#endif
+};
+
+#if defined(SIMD_X86) && defined(_MSC_VER)
+static int cpu_has(int level)
+{
+	int info[4];
+	unsigned long long xcr0;
+
+	__cpuid(info, 1);
+	if (!(info[3] & (1 << 26)))   /* sse2 */
+		return 0;
+	if (level == SIMD_SSE2)
+		return 1;
+	/* osxsave and avx, then the OS must save ymm (and zmm) state */
+	if ((info[2] & ((1 << 27) | (1 << 28))) != ((1 << 27) | (1 << 28)))
+		return 0;
+	xcr0 = _xgetbv(0);
+	if ((xcr0 & 0x6) != 0x6)
+		return 0;
+	__cpuidex(info, 7, 0);
+	if (level == SIMD_AVX2)
+		return (info[1] & (1 << 5)) != 0;
+	/* avx512f and avx512bw */
+	return ((xcr0 & 0xE6) == 0xE6) &&
+		((info[1] & ((1 << 16) | (1 << 30))) == ((1 << 16) | (1 << 30)));
+}
+#elif defined(SIMD_X86) && defined(__GNUC__)
+static int cpu_has(int level)
+{
+	__builtin_cpu_init();
+	switch (level) {
+	case SIMD_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case SIMD_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case SIMD_AVX512:
+		return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+	}
+	return 0;
+}
+#else
+static int cpu_has(int level)
+{
+#if defined(SIMD_NEON)
+	/* NEON is mandatory on AArch64 */
+	return level == SIMD_NEON_;
+#else
+	(void)level;
+	return 0;
+#endif
+}
+#endif
+
+int bsdiff_simd_impls(const struct bsdiff_simd_impl **impls, int max)
+{
+	int i, n = 0;
+
+	for (i = 0; i < (int)(sizeof(simd_impls) / sizeof(simd_impls[0])) && n < max; i++) {
+		if (simd_impls[i].name != NULL && (i == SIMD_SCALAR || cpu_has(i)))
+			impls[n++] = &simd_impls[i];
+	}
+	return n;
+}
+
+/* The widest implementation, picked once: the kernels may first be called
+   from several threads at the same time. */
+static const struct bsdiff_simd_impl *simd_best;
+
+static void simd_select(void)
+{
+	const struct bsdiff_simd_impl *impls[8];
+	int count = bsdiff_simd_impls(impls, 8);
+
+	simd_best = impls[count - 1];
+}
+
+#if defined(_WIN32)
+static INIT_ONCE simd_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK simd_select_once(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+	(void)once; (void)param; (void)context;
+	simd_select();
+	return TRUE;
+}
+
+static const struct bsdiff_simd_impl *simd_impl(void)
+{
+	InitOnceExecuteOnce(&simd_once, simd_select_once, NULL, NULL);
+	return simd_best;
+}
+#else
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+static const struct bsdiff_simd_impl *simd_impl(void)
+{
+	pthread_once(&simd_once, simd_select);
+	return simd_best;
+}
+#endif
+
+int64_t bsdiff_matchlen(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	return simd_impl()->matchlen(a, b, n);
+}
+
+void bsdiff_sub(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	simd_impl()->sub(dst, a, b, n);
+}
+
+int64_t bsdiff_eqcount(const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	return simd_impl()->eqcount(a, b, n);
+}
+
+void bsdiff_add(uint8_t *dst, const uint8_t *a, const uint8_t *b, int64_t n)
+{
+	simd_impl()->add(dst, a, b, n);
+}
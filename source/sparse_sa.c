@@ -0,0 +1,160 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <string.h>
+
+/*
+ * Sparse suffix array: the suffixes of old starting at multiples of k are
+ * the suffixes of the string of k-byte blocks of old. The blocks are ranked
+ * with a radix sort, then those suffixes are sorted by prefix doubling with
+ * the qsufsort of the original bsdiff (Larsson and Sadakane), which works
+ * on any integer alphabet.
+ */
+
+static void split(int32_t *I, int32_t *V, int32_t start, int32_t len, int32_t h)
+{
+	int32_t i, j, k, x, tmp, jj, kk;
+
+	if (len < 16) {
+		for (k = start; k < start + len; k += j) {
+			j = 1; x = V[I[k] + h];
+			for (i = 1; k + i < start + len; i++) {
+				if (V[I[k + i] + h] < x) {
+					x = V[I[k + i] + h];
+					j = 0;
+				}
+				if (V[I[k + i] + h] == x) {
+					tmp = I[k + j]; I[k + j] = I[k + i]; I[k + i] = tmp;
+					j++;
+				}
+			}
+			for (i = 0; i < j; i++)
+				V[I[k + i]] = k + j - 1;
+			if (j == 1)
+				I[k] = -1;
+		}
+		return;
+	}
+
+	x = V[I[start + len / 2] + h];
+	jj = 0; kk = 0;
+	for (i = start; i < start + len; i++) {
+		if (V[I[i] + h] < x) jj++;
+		if (V[I[i] + h] == x) kk++;
+	}
+	jj += start; kk += jj;
+
+	i = start; j = 0; k = 0;
+	while (i < jj) {
+		if (V[I[i] + h] < x) {
+			i++;
+		} else if (V[I[i] + h] == x) {
+			tmp = I[i]; I[i] = I[jj + j]; I[jj + j] = tmp;
+			j++;
+		} else {
+			tmp = I[i]; I[i] = I[kk + k]; I[kk + k] = tmp;
+			k++;
+		}
+	}
+
+	while (jj + j < kk) {
+		if (V[I[jj + j] + h] == x) {
+			j++;
+		} else {
+			tmp = I[jj + j]; I[jj + j] = I[kk + k]; I[kk + k] = tmp;
+			k++;
+		}
+	}
+
+	if (jj > start)
+		split(I, V, start, jj - start, h);
+
+	for (i = 0; i < kk - jj; i++)
+		V[I[jj + i]] = kk - 1;
+	if (jj == kk - 1)
+		I[jj] = -1;
+
+	if (start + len > kk)
+		split(I, V, kk, start + len - kk, h);
+}
+
+/* Digit d of block i: 0 past the end of old, so shorter blocks sort first */
+static inline int block_digit(const uint8_t *old, int64_t oldsize, int k, int32_t i, int d)
+{
+	int64_t p = (int64_t)i * k + d;
+	return (p < oldsize) ? old[p] + 1 : 0;
+}
+
+static int same_block(const uint8_t *old, int64_t oldsize, int k, int32_t a, int32_t b)
+{
+	int d;
+	for (d = 0; d < k; d++) {
+		if (block_digit(old, oldsize, k, a, d) != block_digit(old, oldsize, k, b, d))
+			return 0;
+	}
+	return 1;
+}
+
+void bsdiff_sparse_sa(const uint8_t *old, int64_t oldsize, int k, int32_t *I, int32_t *V)
+{
+	int32_t m = (int32_t)((oldsize + k - 1) / k);
+	int32_t i, j, h, len, start;
+	int32_t count[257];
+	int32_t *src, *dst, *tmp;
+	int d, c;
+
+	/* LSD radix sort of the blocks into I[1..m], V is the other buffer */
+	src = I + 1; dst = V;
+	for (i = 0; i < m; i++)
+		src[i] = i;
+	for (d = k - 1; d >= 0; d--) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < m; i++)
+			count[block_digit(old, oldsize, k, i, d)]++;
+		for (c = 0, j = 0; c < 257; c++) {
+			len = count[c]; count[c] = j; j += len;
+		}
+		for (i = 0; i < m; i++)
+			dst[count[block_digit(old, oldsize, k, src[i], d)]++] = src[i];
+		tmp = src; src = dst; dst = tmp;
+	}
+	if (src != I + 1)
+		memcpy(I + 1, src, (size_t)m * sizeof(int32_t));
+
+	/* V[i] is the last index of the group of equal blocks of i */
+	I[0] = m;
+	V[m] = 0;
+	for (i = m, j = m; i >= 1; i--) {
+		if (i < m && !same_block(old, oldsize, k, I[i], I[i + 1]))
+			j = i;
+		V[I[i]] = j;
+	}
+	/* sorted (single) groups are marked with -1 */
+	for (i = 1, start = 1; i <= m; i++) {
+		if (V[I[i]] == i) {
+			if (start == i)
+				I[i] = -1;
+			start = i + 1;
+		}
+	}
+	I[0] = -1;
+
+	for (h = 1; I[0] != -(m + 1); h += h) {
+		len = 0;
+		for (i = 0; i < m + 1;) {
+			if (I[i] < 0) {
+				len -= I[i];
+				i -= I[i];
+			} else {
+				if (len) I[i - len] = -len;
+				len = V[I[i]] + 1 - i;
+				split(I, V, i, len, h);
+				i += len;
+				len = 0;
+			}
+		}
+		if (len) I[i - len] = -len;
+	}
+
+	for (i = 0; i < m + 1; i++)
+		I[V[i]] = i;
+}
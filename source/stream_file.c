@@ -1,4 +1,5 @@
 #include "bsdiff.h"
+#include "bsdiff_private.h"
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -119,6 +120,31 @@ static int filestream_getmode_write(void *state)
 {
 	return BSDIFF_MODE_WRITE;
 }
+/**
+ * @brief switch a temporary file stream between writing and reading, the
+ *   caller seeks to where reading starts before switching
+ *
+ * @param bsdiff_str point address of bsdiff_stream
+ * @param mode
+ * @return int mode
+ */
+static int filestream_setmode(void *bsdiff_str, int mode)
+{
+	struct bsdiff_stream *stream = (struct bsdiff_stream*)bsdiff_str;
+
+	if (mode == BSDIFF_MODE_READ) {
+		stream->get_mode = filestream_getmode_read;
+		stream->read = filestream_read;
+		stream->write = NULL;
+		stream->flush = NULL;
+	} else {
+		stream->get_mode = filestream_getmode_write;
+		stream->read = NULL;
+		stream->write = filestream_write;
+		stream->flush = filestream_flush;
+	}
+	return mode;
+}
 /**
  * @brief 
  * 
@@ -157,3 +183,25 @@ int bsdiff_open_file_stream(
 
 	return BSDIFF_SUCCESS;
 }
+
+int bsdiff_open_tmpfile_stream(
+	struct bsdiff_stream *stream)
+{
+	FILE *f;
+	assert(stream);
+
+	/* removed by the system once closed */
+	f = tmpfile();
+	if (f == NULL)
+		return BSDIFF_FILE_ERROR;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->state = f;
+	stream->close = filestream_close;
+	stream->set_mode = filestream_setmode;
+	stream->seek = filestream_seek;
+	stream->tell = filestream_tell;
+	filestream_setmode(stream, BSDIFF_MODE_WRITE);
+
+	return BSDIFF_SUCCESS;
+}
@@ -1,4 +1,5 @@
 #include "bsdiff.h"
+#include "bsdiff_private.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -95,6 +96,7 @@ static int memstream_read(void *state, void *buffer, size_t size, size_t *readed
 	memcpy(buffer, (uint8_t*)s->buffer + s->pos, cb);
 
 	s->pos += cb;
+	*readed = cb;
 
 	return (cb < size) ? BSDIFF_END_OF_FILE : BSDIFF_SUCCESS;
 }
@@ -192,11 +194,6 @@ static int memstream_flush(void *state)
 static int memstream_getbuffer(void *state, const void **ppbuffer, size_t *psize)
 {
 	struct memstream_state *s = (struct memstream_state*)state;
-	fprintf(stderr, " memstream_getbuffer patch packer %s, size = %d\n", s->buffer, s->size);
-	//void* newbuf = malloc(s->size);
-    /* memcpy */
-    //memcpy((uint8_t*)newbuf, s->buffer, s->size);
-	//fprintf(stderr, " memstream_getbuffer patch packer %s, size = %d\n", newbuf, s->size);
 	*ppbuffer = s->buffer;
 	*psize = s->size;
 
@@ -273,24 +270,22 @@ int bsdiff_open_memory_stream(
 	assert(mode >= BSDIFF_MODE_READ && mode <= BSDIFF_MODE_WRITE);
 	assert(stream);
 
+	/* read mode needs a buffer (unless empty), write mode allocates its own */
+	if ((mode == BSDIFF_MODE_READ) ? (buffer == NULL && size > 0) : (buffer != NULL))
+		return BSDIFF_INVALID_ARG;
+
 	state = malloc(sizeof(struct memstream_state));
 	if (state == NULL)
 		return BSDIFF_OUT_OF_MEMORY;
 
 	if (mode == BSDIFF_MODE_READ) {
 		/* read mode */
-		if (buffer == NULL) {
-			return BSDIFF_INVALID_ARG;
-		}
 		state->mode = BSDIFF_MODE_READ;
 		state->buffer = (void*)buffer;
 		state->capacity = size;
 		state->size = size;
 	} else {
 		/* write mode */
-		if (buffer != NULL) {
-			return BSDIFF_INVALID_ARG;
-		}
 		state->mode = BSDIFF_MODE_WRITE;
 		state->size = 0;
 		if (size > 0) {
@@ -326,3 +321,18 @@ int bsdiff_open_memory_stream(
 	return BSDIFF_SUCCESS;
 }
 
+
+void bsdiff_memory_stream_detach(
+	struct bsdiff_stream *stream,
+	void **pbuffer,
+	size_t *psize)
+{
+	struct memstream_state *s = (struct memstream_state*)stream->state;
+
+	assert(s->mode == BSDIFF_MODE_WRITE);
+
+	*pbuffer = s->buffer;
+	*psize = s->size;
+	s->buffer = NULL;
+	s->size = s->capacity = s->pos = 0;
+}
@@ -0,0 +1,213 @@
+#include "bsdiff.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* A read-only mapping of the whole file */
+struct mmapstream_state
+{
+	const uint8_t *buffer;
+	size_t size;
+	size_t pos;
+#if defined(_WIN32)
+	HANDLE mapping;
+#endif
+};
+
+/* Empty files can't be mapped, they are backed by this byte instead */
+static const uint8_t empty_buffer[1];
+
+static int mmapstream_seek(void *state, int64_t offset, int origin)
+{
+	struct mmapstream_state *s = (struct mmapstream_state*)state;
+	int64_t newpos = -1;
+
+	switch (origin) {
+	case BSDIFF_SEEK_SET:
+		newpos = offset;
+		break;
+	case BSDIFF_SEEK_CUR:
+		newpos = (int64_t)s->pos + offset;
+		break;
+	case BSDIFF_SEEK_END:
+		newpos = (int64_t)s->size + offset;
+		break;
+	}
+	if (newpos < 0 || newpos > (int64_t)s->size)
+		return BSDIFF_INVALID_ARG;
+
+	s->pos = (size_t)newpos;
+
+	return BSDIFF_SUCCESS;
+}
+
+static int mmapstream_tell(void *state, int64_t *position)
+{
+	struct mmapstream_state *s = (struct mmapstream_state*)state;
+	*position = (int64_t)s->pos;
+	return BSDIFF_SUCCESS;
+}
+
+static int mmapstream_read(void *state, void *buffer, size_t size, size_t *readed)
+{
+	struct mmapstream_state *s = (struct mmapstream_state*)state;
+	size_t cb;
+
+	*readed = 0;
+
+	if (size == 0)
+		return BSDIFF_SUCCESS;
+
+	cb = size;
+	if (s->pos + size > s->size)
+		cb = s->size - s->pos;
+
+	memcpy(buffer, s->buffer + s->pos, cb);
+	s->pos += cb;
+	*readed = cb;
+
+	return (cb < size) ? BSDIFF_END_OF_FILE : BSDIFF_SUCCESS;
+}
+
+static int mmapstream_getbuffer(void *state, const void **ppbuffer, size_t *psize)
+{
+	struct mmapstream_state *s = (struct mmapstream_state*)state;
+	*ppbuffer = s->buffer;
+	*psize = s->size;
+	return BSDIFF_SUCCESS;
+}
+
+static int mmapstream_getmode(void *state)
+{
+	(void)state;
+	return BSDIFF_MODE_READ;
+}
+
+static void mmapstream_close(void *state)
+{
+	struct mmapstream_state *s = (struct mmapstream_state*)state;
+
+	if (s->buffer != empty_buffer) {
+#if defined(_WIN32)
+		UnmapViewOfFile(s->buffer);
+		CloseHandle(s->mapping);
+#else
+		munmap((void*)s->buffer, s->size);
+#endif
+	}
+
+	free(s);
+}
+
+#if defined(_WIN32)
+static int map_file(const char *filename, struct mmapstream_state *s)
+{
+	HANDLE file;
+	LARGE_INTEGER size;
+	int ret = BSDIFF_FILE_ERROR;
+
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return BSDIFF_FILE_ERROR;
+	if (!GetFileSizeEx(file, &size))
+		goto cleanup;
+	if ((uint64_t)size.QuadPart >= SIZE_MAX) {
+		ret = BSDIFF_SIZE_TOO_LARGE;
+		goto cleanup;
+	}
+	s->size = (size_t)size.QuadPart;
+	if (s->size == 0) {
+		s->buffer = empty_buffer;
+		ret = BSDIFF_SUCCESS;
+		goto cleanup;
+	}
+	s->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (s->mapping == NULL)
+		goto cleanup;
+	s->buffer = MapViewOfFile(s->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (s->buffer == NULL) {
+		CloseHandle(s->mapping);
+		goto cleanup;
+	}
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	CloseHandle(file);
+	return ret;
+}
+#else
+static int map_file(const char *filename, struct mmapstream_state *s)
+{
+	int fd;
+	struct stat st;
+	void *p;
+	int ret = BSDIFF_FILE_ERROR;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return BSDIFF_FILE_ERROR;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		goto cleanup;
+	if ((uint64_t)st.st_size >= SIZE_MAX) {
+		ret = BSDIFF_SIZE_TOO_LARGE;
+		goto cleanup;
+	}
+	s->size = (size_t)st.st_size;
+	if (s->size == 0) {
+		s->buffer = empty_buffer;
+		ret = BSDIFF_SUCCESS;
+		goto cleanup;
+	}
+	p = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		goto cleanup;
+	/* bsdiff scans the whole file, read ahead aggressively */
+	madvise(p, s->size, MADV_WILLNEED);
+	s->buffer = (const uint8_t*)p;
+	ret = BSDIFF_SUCCESS;
+
+cleanup:
+	close(fd);
+	return ret;
+}
+#endif
+
+int bsdiff_open_mmap_stream(
+	const char *filename,
+	struct bsdiff_stream *stream)
+{
+	struct mmapstream_state *state;
+	int ret;
+	assert(filename);
+	assert(stream);
+
+	state = calloc(1, sizeof(struct mmapstream_state));
+	if (state == NULL)
+		return BSDIFF_OUT_OF_MEMORY;
+
+	if ((ret = map_file(filename, state)) != BSDIFF_SUCCESS) {
+		free(state);
+		return ret;
+	}
+
+	memset(stream, 0, sizeof(*stream));
+	stream->state = state;
+	stream->close = mmapstream_close;
+	stream->get_mode = mmapstream_getmode;
+	stream->seek = mmapstream_seek;
+	stream->tell = mmapstream_tell;
+	stream->read = mmapstream_read;
+	stream->get_buffer = mmapstream_getbuffer;
+
+	return BSDIFF_SUCCESS;
+}
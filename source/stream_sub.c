@@ -126,7 +126,7 @@ int bsdiff_open_substream(
 	{
 		return BSDIFF_ERROR;
 	}
-	if (read_start < 0 || read_end <= read_start || read_end > base_size)
+	if (read_start < 0 || read_end < read_start || read_end > base_size)
 		return BSDIFF_INVALID_ARG;
 
 	state = malloc(sizeof(struct substream_state));
@@ -0,0 +1,104 @@
+#include "bsdiff.h"
+#include "bsdiff_private.h"
+#include <stdlib.h>
+#if defined(_WIN32)
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+
+struct parallel_task
+{
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int i;
+};
+
+#if defined(_WIN32)
+static unsigned __stdcall parallel_task_main(void *p)
+#else
+static void *parallel_task_main(void *p)
+#endif
+{
+	struct parallel_task *task = (struct parallel_task*)p;
+	task->fn(task->arg, task->i);
+	return 0;
+}
+
+void bsdiff_parallel_for(int n, void (*fn)(void *arg, int i), void *arg)
+{
+	struct parallel_task *tasks;
+	int i;
+#if defined(_WIN32)
+	HANDLE *threads;
+#else
+	pthread_t *threads;
+#endif
+
+	if (n <= 1) {
+		if (n == 1)
+			fn(arg, 0);
+		return;
+	}
+
+	tasks = malloc(sizeof(*tasks) * (size_t)n);
+	threads = malloc(sizeof(*threads) * (size_t)n);
+	if (tasks == NULL || threads == NULL) {
+		/* run everything on the calling thread */
+		for (i = 0; i < n; i++)
+			fn(arg, i);
+		goto cleanup;
+	}
+
+	/* task 0 runs on the calling thread, a task whose thread
+	   can't be started runs there as well */
+	for (i = 1; i < n; i++) {
+		tasks[i].fn = fn;
+		tasks[i].arg = arg;
+		tasks[i].i = i;
+#if defined(_WIN32)
+		threads[i] = (HANDLE)_beginthreadex(NULL, 0, parallel_task_main, &tasks[i], 0, NULL);
+		if (threads[i] == 0) {
+#else
+		if (pthread_create(&threads[i], NULL, parallel_task_main, &tasks[i]) != 0) {
+#endif
+			tasks[i].fn = NULL;
+		}
+	}
+	fn(arg, 0);
+	for (i = 1; i < n; i++) {
+		if (tasks[i].fn == NULL) {
+			fn(arg, i);
+			continue;
+		}
+#if defined(_WIN32)
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+	}
+
+cleanup:
+	free(threads);
+	free(tasks);
+}
+
+int bsdiff_flag_get(volatile int *flag)
+{
+#if defined(_MSC_VER)
+	return (int)InterlockedCompareExchange((volatile LONG*)flag, 0, 0);
+#else
+	return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void bsdiff_flag_set(volatile int *flag)
+{
+#if defined(_MSC_VER)
+	InterlockedExchange((volatile LONG*)flag, 1);
+#else
+	__atomic_store_n(flag, 1, __ATOMIC_RELEASE);
+#endif
+}
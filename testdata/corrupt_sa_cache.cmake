@@ -0,0 +1,10 @@
+# Damages every suffix array cache in SA_CACHE_DIR, keeping the file sizes
+file(GLOB caches "${SA_CACHE_DIR}/*.sa")
+if (NOT caches)
+    message(FATAL_ERROR "no suffix array cache in ${SA_CACHE_DIR}")
+endif()
+foreach(cache ${caches})
+    file(SIZE ${cache} size)
+    string(REPEAT "x" ${size} garbage)
+    file(WRITE ${cache} "${garbage}")
+endforeach()
@@ -0,0 +1,24 @@
+# Rebuilds ranges of NEWFILE with bspatch -r from the framed PATCHFILE, at
+# and across the 64 KiB frame boundaries, and compares them with NEWFILE
+file(SIZE ${NEWFILE} size)
+math(EXPR last "${size} - 7")
+set(ranges "0 10" "65530 20" "65536 65536" "100000 300000" "${last} 7" "${size} 0" "0 ${size}")
+foreach(range ${ranges})
+    separate_arguments(range)
+    list(GET range 0 offset)
+    list(GET range 1 length)
+    execute_process(COMMAND ${BSPATCH} -r ${offset} ${length} ${OLDFILE} ${OUTFILE} ${PATCHFILE}
+        RESULT_VARIABLE ret)
+    if (NOT ret EQUAL 0)
+        message(FATAL_ERROR "bspatch -r ${offset} ${length} failed: ${ret}")
+    endif()
+    file(READ ${OUTFILE} actual HEX)
+    if (length EQUAL 0)
+        set(expected "")
+    else()
+        file(READ ${NEWFILE} expected OFFSET ${offset} LIMIT ${length} HEX)
+    endif()
+    if (NOT actual STREQUAL expected)
+        message(FATAL_ERROR "range ${offset} ${length} differs")
+    endif()
+endforeach()